@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include "common.h"
+#include "aa_server.h"
+
+static uint8_t *read_file(const char *filename, size_t *size);
+
+int main(int argc, char **argv) {
+    char *server_path = NULL;
+    char *image_file = NULL;
+    char *output_file = NULL;
+    uint32_t output = AA_OUTPUT_TEXT;
+    int opt;
+    while ((opt = getopt(argc, argv, "D:i:f:o:")) != -1) {
+        switch (opt) {
+            case 'D':
+                server_path = optarg;
+                break;
+            case 'i':
+                image_file = optarg;
+                break;
+            case 'f':
+                if (!parse_aa_output(optarg, &output)) {
+                    ERR("不明な出力形式です: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                output_file = optarg;
+                break;
+        }
+    }
+    if (server_path == NULL || image_file == NULL) {
+        ERR("使用方法: aa_client -D <socket> -i <image> [-f <text|bin|rle|png>] [-o <output>]");
+        return EXIT_FAILURE;
+    }
+    size_t size;
+    uint8_t *data = read_file(image_file, &size);
+    if (size > AA_REQUEST_MAX_SIZE) {
+        ERR("画像が大きすぎます: %zu バイト", size);
+        return EXIT_FAILURE;
+    }
+    int fd = connect_aa_server(server_path);
+    aa_request_t request;
+    memset(&request, 0, sizeof(request));
+    memcpy(request.magic, AA_REQUEST_MAGIC, sizeof(request.magic));
+    request.output = output;
+    request.size = size;
+    if (!write_fully(fd, &request, sizeof(request)) || !write_fully(fd, data, size)) {
+        ERR("要求を送信できませんでした");
+        return EXIT_FAILURE;
+    }
+    free(data);
+    aa_response_t response;
+    if (!read_fully(fd, &response, sizeof(response)) ||
+        memcmp(response.magic, AA_RESPONSE_MAGIC, sizeof(response.magic)) != 0) {
+        ERR("応答を受信できませんでした");
+        return EXIT_FAILURE;
+    }
+    uint8_t *result = xmalloc(response.size + 1);
+    if (!read_fully(fd, result, response.size)) {
+        ERR("応答を受信できませんでした");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    if (response.status != AA_STATUS_OK) {
+        result[response.size] = 0;
+        ERR("変換に失敗しました: %s", (char *) result);
+        return EXIT_FAILURE;
+    }
+    FILE *file = stdout;
+    if (output_file != NULL) {
+        file = fopen(output_file, "wb");
+        if (file == NULL) {
+            perror(output_file);
+            return EXIT_FAILURE;
+        }
+    }
+    if (response.size > 0 && fwrite(result, response.size, 1, file) != 1) {
+        perror("");
+        return EXIT_FAILURE;
+    }
+    if (file != stdout) {
+        fclose(file);
+    }
+    free(result);
+    return EXIT_SUCCESS;
+}
+
+// ファイル名が "-" の場合は標準入力から読み出す
+static uint8_t *read_file(const char *filename, size_t *size) {
+    FILE *file = stdin;
+    if (strcmp(filename, "-") != 0) {
+        file = fopen(filename, "rb");
+        if (file == NULL) {
+            perror(filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t capacity = 64 * 1024;
+    uint8_t *data = xmalloc(capacity);
+    *size = 0;
+    size_t n;
+    while ((n = fread(data + *size, 1, capacity - *size, file)) > 0) {
+        *size += n;
+        if (*size == capacity) {
+            capacity *= 2;
+            data = xrealloc(data, capacity);
+        }
+    }
+    if (ferror(file)) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    if (file != stdin) {
+        fclose(file);
+    }
+    return data;
+}
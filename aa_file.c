@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <string.h>
+#include "aa_file.h"
+
+static void read_aa_text(FILE *file, aa_t *aa);
+static void read_aa_binary(FILE *file, aa_t *aa);
+static void read_aa_words(FILE *file, uint16_t *words, size_t count);
+
+int parse_aa_format(const char *name, aa_format_t *format) {
+    if (strcmp(name, "text") == 0) {
+        *format = AA_FORMAT_TEXT;
+    } else if (strcmp(name, "bin") == 0) {
+        *format = AA_FORMAT_BINARY;
+    } else if (strcmp(name, "rle") == 0) {
+        *format = AA_FORMAT_RLE;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// ヘッダを書き出す。テキスト形式は "幅 高さ" の1行
+void init_aa_writer(aa_writer_t *writer, FILE *file, aa_format_t format, int width, int height) {
+    writer->file = file;
+    writer->format = format;
+    writer->width = width;
+    // テキスト形式は1文字最大3バイトと改行、RLEは最悪で1文字ごとに2語
+    writer->buffer = xmalloc(sizeof(uint16_t) * 2 * width + 3 * width + 1);
+    if (format == AA_FORMAT_TEXT) {
+        fprintf(file, "%d %d\n", width, height);
+        return;
+    }
+    binary_aa_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_AA_MAGIC, sizeof(header.magic));
+    header.version = BINARY_AA_VERSION;
+    header.byte_order = BINARY_AA_BYTE_ORDER;
+    header.width = width;
+    header.height = height;
+    header.flags = format == AA_FORMAT_RLE ? BINARY_AA_RLE : 0;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        perror("");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void write_aa_row(aa_writer_t *writer, const uint32_t *row) {
+    size_t size = 0;
+    if (writer->format == AA_FORMAT_TEXT) {
+        char *c = (char *) writer->buffer;
+        for (int x = 0; x < writer->width; x++) {
+            size += write_unicode_as_utf8(c + size, row[x]);
+        }
+        c[size++] = '\n';
+    } else {
+        uint16_t *words = (uint16_t *) writer->buffer;
+        size_t count = 0;
+        for (int x = 0; x < writer->width; x++) {
+            if (row[x] > UINT16_MAX) {
+                ERR("バイナリ形式のAAで扱えない文字です: U+%X", row[x]);
+                exit(EXIT_FAILURE);
+            }
+            if (writer->format == AA_FORMAT_BINARY) {
+                words[count++] = row[x];
+            } else if (count > 0 && words[count - 1] == row[x] && words[count - 2] < UINT16_MAX) {
+                words[count - 2]++;
+            } else {
+                words[count++] = 1;
+                words[count++] = row[x];
+            }
+        }
+        size = sizeof(uint16_t) * count;
+    }
+    if (size > 0 && fwrite(writer->buffer, size, 1, writer->file) != 1) {
+        perror("");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void free_aa_writer(aa_writer_t *writer) {
+    free(writer->buffer);
+}
+
+// 先頭のマジックで形式を判別して読み込む
+void read_aa_file(const char *filename, aa_t *aa) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    char magic[sizeof(BINARY_AA_MAGIC) - 1];
+    int binary = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, BINARY_AA_MAGIC, sizeof(magic)) == 0;
+    if (fseek(file, 0, SEEK_SET) != 0) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    if (binary) {
+        read_aa_binary(file, aa);
+    } else {
+        read_aa_text(file, aa);
+    }
+    fclose(file);
+}
+
+static void read_aa_text(FILE *file, aa_t *aa) {
+    int width, height;
+    if (fscanf(file, "%d %d\n", &width, &height) != 2 || width < 1 || height < 1) {
+        ERR("AAファイルの読み出しに失敗しました");
+        exit(EXIT_FAILURE);
+    }
+    init_aa(aa, width, height);
+    int line_max = (aa->width + 1) * 3;
+    char *line = xmalloc(line_max);
+    for (int y = 0; y < aa->height; y++) {
+        if (fgets(line, line_max, file) == NULL) {
+            ERR("AAファイルの読み出しに失敗しました");
+            exit(EXIT_FAILURE);
+        }
+        int pos = 0;
+        for (int x = 0; x < aa->width; x++) {
+            int size;
+            int unicode = read_utf8_as_unicode(&line[pos], &size);
+            if (size == 0) {
+                ERR("AAファイルの読み出しに失敗しました");
+                exit(EXIT_FAILURE);
+            }
+            aa->map[y][x] = unicode;
+            pos += size;
+        }
+    }
+    free(line);
+}
+
+static void read_aa_binary(FILE *file, aa_t *aa) {
+    binary_aa_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1) {
+        ERR("AAファイルの読み出しに失敗しました");
+        exit(EXIT_FAILURE);
+    }
+    if (header.version != BINARY_AA_VERSION ||
+        header.byte_order != BINARY_AA_BYTE_ORDER ||
+        (header.flags & ~BINARY_AA_RLE) != 0) {
+        ERR("対応していないAAファイルの形式です");
+        exit(EXIT_FAILURE);
+    }
+    if (header.width < 1 || header.width > INT32_MAX || header.height < 1 || header.height > INT32_MAX) {
+        ERR("AAファイルが壊れています");
+        exit(EXIT_FAILURE);
+    }
+    init_aa(aa, header.width, header.height);
+    uint16_t *words = xmalloc(sizeof(uint16_t) * aa->width);
+    for (int y = 0; y < aa->height; y++) {
+        if ((header.flags & BINARY_AA_RLE) == 0) {
+            read_aa_words(file, words, aa->width);
+            for (int x = 0; x < aa->width; x++) {
+                aa->map[y][x] = words[x];
+            }
+            continue;
+        }
+        int x = 0;
+        while (x < aa->width) {
+            uint16_t run[2];
+            read_aa_words(file, run, 2);
+            if (run[0] == 0 || run[0] > aa->width - x) {
+                ERR("AAファイルが壊れています");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < run[0]; i++) {
+                aa->map[y][x++] = run[1];
+            }
+        }
+    }
+    free(words);
+}
+
+static void read_aa_words(FILE *file, uint16_t *words, size_t count) {
+    if (fread(words, sizeof(uint16_t), count, file) != count) {
+        ERR("AAファイルの読み出しに失敗しました");
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef AA_FILE_H
+#define AA_FILE_H
+
+#include "common.h"
+
+#define BINARY_AA_MAGIC "P2AAGRID"
+#define BINARY_AA_VERSION 1
+#define BINARY_AA_BYTE_ORDER 0x01020304
+#define BINARY_AA_RLE 0x1
+
+// バイナリ形式のAAのヘッダ。続けて各行の文字コードを uint16_t で並べる
+// BINARY_AA_RLE の場合は、行ごとに (連続数, 文字コード) の uint16_t の組を並べる。連続は行をまたがない
+typedef struct binary_aa_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t width;
+    uint32_t height;
+    uint32_t flags;
+    uint32_t reserved;
+} binary_aa_header_t;
+
+typedef enum aa_format_t {
+    AA_FORMAT_TEXT,
+    AA_FORMAT_BINARY,
+    AA_FORMAT_RLE,
+} aa_format_t;
+
+// AAを1行ずつ書き出す。行は buffer にまとめてから1回で書き出す
+typedef struct aa_writer_t {
+    FILE *file;
+    aa_format_t format;
+    int width;
+    uint8_t *buffer;
+} aa_writer_t;
+
+int parse_aa_format(const char *name, aa_format_t *format);
+void init_aa_writer(aa_writer_t *writer, FILE *file, aa_format_t format, int width, int height);
+void write_aa_row(aa_writer_t *writer, const uint32_t *row);
+void free_aa_writer(aa_writer_t *writer);
+void read_aa_file(const char *filename, aa_t *aa);
+
+#endif //AA_FILE_H
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "common.h"
+#include "aa_server.h"
+
+static void init_address(struct sockaddr_un *address, const char *path);
+
+int parse_aa_output(const char *name, uint32_t *output) {
+    if (strcmp(name, "text") == 0) {
+        *output = AA_OUTPUT_TEXT;
+    } else if (strcmp(name, "bin") == 0) {
+        *output = AA_OUTPUT_BINARY;
+    } else if (strcmp(name, "rle") == 0) {
+        *output = AA_OUTPUT_RLE;
+    } else if (strcmp(name, "png") == 0) {
+        *output = AA_OUTPUT_PNG;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// 前回の実行で残ったソケットファイルは削除してから待ち受ける
+int listen_aa_server(const char *path, int backlog) {
+    struct sockaddr_un address;
+    init_address(&address, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (listen(fd, backlog) != 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+int connect_aa_server(const char *path) {
+    struct sockaddr_un address;
+    init_address(&address, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// size バイトすべて読み出せれば 1、途中で切断されるかエラーであれば 0 を返す
+int read_fully(int fd, void *data, size_t size) {
+    uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+int write_fully(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static void init_address(struct sockaddr_un *address, const char *path) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        ERR("ソケットのパスが長すぎます: %s", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address->sun_path, path);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef AA_SERVER_H
+#define AA_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 常駐サーバとのやり取り。1回の接続で、要求ヘッダとPNGのデータを送り、応答ヘッダと結果を受け取る
+// 同じ計算機内の Unix ドメインソケットでのみ使うため、整数はホストのバイト順のまま送る
+#define AA_REQUEST_MAGIC "P2AQ"
+#define AA_RESPONSE_MAGIC "P2AR"
+#define AA_REQUEST_MAX_SIZE (64 * 1024 * 1024)
+
+// 出力形式。AA_OUTPUT_TEXT から AA_OUTPUT_RLE は aa_format_t と同じ値
+#define AA_OUTPUT_TEXT 0
+#define AA_OUTPUT_BINARY 1
+#define AA_OUTPUT_RLE 2
+#define AA_OUTPUT_PNG 3
+
+// 応答の状態。AA_STATUS_ERROR の場合、結果の代わりにエラーメッセージを送る
+#define AA_STATUS_OK 0
+#define AA_STATUS_ERROR 1
+
+typedef struct aa_request_t {
+    char magic[4];
+    uint32_t output;
+    uint32_t size;
+    uint32_t reserved;
+} aa_request_t;
+
+typedef struct aa_response_t {
+    char magic[4];
+    uint32_t status;
+    uint32_t size;
+    uint32_t reserved;
+} aa_response_t;
+
+int parse_aa_output(const char *name, uint32_t *output);
+int listen_aa_server(const char *path, int backlog);
+int connect_aa_server(const char *path);
+int read_fully(int fd, void *data, size_t size);
+int write_fully(int fd, const void *data, size_t size);
+
+#endif //AA_SERVER_H
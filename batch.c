@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <limits.h>
+#include "batch.h"
+
+static int dot_product(uint8_t *a, uint8_t *b);
+static int argmin_l2(batch_t *batch, uint8_t *sample, int start, int end, int *min);
+
+void init_batch(batch_t *batch, flat_book_t *flat_book, metric_t metric) {
+    batch->flat_book = flat_book;
+    batch->metric = metric;
+    batch->norm = NULL;
+    if (metric == METRIC_L2) {
+        batch->norm = xmalloc(sizeof(int) * flat_book->size);
+        for (int i = 0; i < flat_book->size; i++) {
+            batch->norm[i] = dot_product(flat_book->code[i], flat_book->code[i]);
+        }
+    }
+}
+
+void free_batch(batch_t *batch) {
+    free(batch->norm);
+}
+
+// count 件のサンプルをまとめて照合する
+// コードブックをブロック単位で読み、キャッシュに載っている間に全サンプルとの距離を計算する
+// ブロックを先頭から順に処理し、各ブロック内でも同距離なら先頭側を優先するため、1件ずつ検索した場合と同じ結果になる
+void match_batch(batch_t *batch, uint8_t (*samples)[CODE_STRIDE], int count, int *index, int *min) {
+    flat_book_t *flat_book = batch->flat_book;
+    for (int s = 0; s < count; s++) {
+        index[s] = 0;
+        min[s] = INT_MAX;
+    }
+    for (int start = 0; start < flat_book->size; start += BATCH_BLOCK_SIZE) {
+        int end = start + BATCH_BLOCK_SIZE < flat_book->size ? start + BATCH_BLOCK_SIZE : flat_book->size;
+        for (int s = 0; s < count; s++) {
+            int found;
+            if (batch->metric == METRIC_L2) {
+                found = argmin_l2(batch, samples[s], start, end, &min[s]);
+            } else {
+                found = argmin_distance(samples[s], flat_book->code + start, end - start, &min[s]);
+            }
+            if (found >= 0) {
+                index[s] = start + found;
+            }
+        }
+    }
+}
+
+static int dot_product(uint8_t *a, uint8_t *b) {
+    int dot = 0;
+    for (int i = 0; i < CODE_SIZE; i++) {
+        dot += a[i] * b[i];
+    }
+    return dot;
+}
+
+// |x - c|^2 = |x|^2 - 2 x・c + |c|^2 と分解し、|c|^2 は事前計算したものを使う
+static int argmin_l2(batch_t *batch, uint8_t *sample, int start, int end, int *min) {
+    uint8_t (*code)[CODE_STRIDE] = batch->flat_book->code;
+    int sample_norm = dot_product(sample, sample);
+    int found = -1;
+    for (int i = start; i < end; i++) {
+        int d = sample_norm + batch->norm[i] - 2 * dot_product(sample, code[i]);
+        if (*min > d) {
+            *min = d;
+            found = i - start;
+        }
+    }
+    return found;
+}
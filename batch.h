@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "flat_book.h"
+
+// コードブックを一度に走査する件数。16バイト * 1024件 = 16KB でL1キャッシュに収まる
+#define BATCH_BLOCK_SIZE 1024
+
+typedef enum metric_t {
+    METRIC_L1,
+    METRIC_L2,
+} metric_t;
+
+typedef struct batch_t {
+    flat_book_t *flat_book;
+    metric_t metric;
+    int *norm;
+} batch_t;
+
+void init_batch(batch_t *batch, flat_book_t *flat_book, metric_t metric);
+void free_batch(batch_t *batch);
+void match_batch(batch_t *batch, uint8_t (*samples)[CODE_STRIDE], int count, int *index, int *min);
+
+#endif //BATCH_H
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "binary_book.h"
+
+static void unique_code_book(code_book_t *code_book, code_book_t *unique);
+static uint64_t write_section(FILE *file, uint64_t offset, const void *data, size_t size);
+static int valid_section(binary_book_t *binary_book, uint64_t offset, size_t size);
+static int valid_kd_tree(binary_book_t *binary_book);
+static int valid_atlas(glyph_atlas_t *atlas);
+
+int is_binary_book_file(char *filename) {
+    int binary;
+    if (!check_binary_book_file(filename, &binary)) {
+        exit(EXIT_FAILURE);
+    }
+    return binary;
+}
+
+// ファイルを開けない場合はメッセージを表示して 0 を返す。開ければ binary に判定結果を書き込む
+int check_binary_book_file(char *filename, int *binary) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror(filename);
+        return 0;
+    }
+    char magic[sizeof(BINARY_BOOK_MAGIC) - 1];
+    *binary = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, BINARY_BOOK_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return 1;
+}
+
+// テキスト形式と同じく、ベクトルの重複を除いて並べ替えた順に書き出す
+// atlas が NULL でなければグリフアトラスも書き出す
+void write_binary_book_file(char *filename, code_book_t *code_book, int with_kd_tree, glyph_atlas_t *atlas) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    code_book_t unique;
+    unique_code_book(code_book, &unique);
+    int size = unique.size;
+    flat_book_t flat_book;
+    init_flat_book(&flat_book, &unique);
+    uint32_t *unicode = xmalloc(sizeof(uint32_t) * (size + 1));
+    for (int i = 0; i < size; i++) {
+        unicode[i] = unique.code[i]->unicode;
+    }
+    binary_book_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_BOOK_MAGIC, sizeof(header.magic));
+    header.version = BINARY_BOOK_VERSION;
+    header.byte_order = BINARY_BOOK_BYTE_ORDER;
+    header.size = size;
+    header.code_stride = CODE_STRIDE;
+    uint64_t offset = write_section(file, 0, &header, sizeof(header));
+    header.code_offset = offset;
+    offset = write_section(file, offset, flat_book.code, sizeof(uint8_t[CODE_STRIDE]) * (size + 1));
+    header.unicode_offset = offset;
+    offset = write_section(file, offset, unicode, sizeof(uint32_t) * size);
+    flat_table_t flat_table;
+    init_flat_table(&flat_table, &unique);
+    header.flags |= BINARY_BOOK_FLAT_TABLE;
+    header.flat_table_offset = offset;
+    offset = write_section(file, offset, &flat_table, sizeof(flat_table));
+    if (with_kd_tree) {
+        kd_tree_t kd_tree;
+        init_kd_tree(&kd_tree, &unique);
+        header.flags |= BINARY_BOOK_KD_TREE;
+        header.node_size = kd_tree.node_size;
+        header.node_offset = offset;
+        offset = write_section(file, offset, kd_tree.node, sizeof(kd_node_t) * kd_tree.node_size);
+        header.order_offset = offset;
+        offset = write_section(file, offset, kd_tree.order, sizeof(int) * size);
+        header.tree_code_offset = offset;
+        offset = write_section(file, offset, kd_tree.code, sizeof(uint8_t[CODE_SIZE]) * size);
+        free_kd_tree(&kd_tree);
+    }
+    if (atlas != NULL) {
+        header.flags |= BINARY_BOOK_GLYPH;
+        header.glyph_size = atlas->size;
+        header.glyph_unicode_offset = offset;
+        offset = write_section(file, offset, atlas->unicode, sizeof(uint32_t) * atlas->size);
+        header.glyph_offset = offset;
+        write_section(file, offset, atlas->glyph, sizeof(uint8_t[GLYPH_PACKED_SIZE]) * atlas->size);
+    }
+    // オフセットが決まったところでヘッダを書き直す
+    if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    free(unicode);
+    free_flat_book(&flat_book);
+    free(unique.code);
+}
+
+// 読み出せないか壊れている場合はメッセージを表示して 0 を返す
+int load_binary_book_file(char *filename, binary_book_t *binary_book) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(filename);
+        close(fd);
+        return 0;
+    }
+    if ((size_t) st.st_size < sizeof(binary_book_header_t)) {
+        ERR("コードブックのヘッダが読み出せません");
+        close(fd);
+        return 0;
+    }
+    void *memory = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror(filename);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    binary_book->memory = memory;
+    binary_book->length = st.st_size;
+    binary_book_header_t *header = memory;
+    binary_book->header = header;
+    if (memcmp(header->magic, BINARY_BOOK_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BINARY_BOOK_VERSION ||
+        header->byte_order != BINARY_BOOK_BYTE_ORDER ||
+        header->code_stride != CODE_STRIDE) {
+        ERR("対応していないコードブックの形式です");
+        unmap_binary_book(binary_book);
+        return 0;
+    }
+    int size = header->size;
+    if (size < 1 ||
+        !valid_section(binary_book, header->code_offset, sizeof(uint8_t[CODE_STRIDE]) * (size + 1)) ||
+        !valid_section(binary_book, header->unicode_offset, sizeof(uint32_t) * size)) {
+        ERR("コードブックが壊れています");
+        unmap_binary_book(binary_book);
+        return 0;
+    }
+    binary_book->size = size;
+    binary_book->code = (uint8_t (*)[CODE_STRIDE]) ((uint8_t *) memory + header->code_offset);
+    binary_book->unicode = (uint32_t *) ((uint8_t *) memory + header->unicode_offset);
+    binary_book->node = NULL;
+    binary_book->order = NULL;
+    binary_book->tree_code = NULL;
+    binary_book->flat_table = NULL;
+    binary_book->atlas.size = 0;
+    binary_book->atlas.unicode = NULL;
+    binary_book->atlas.glyph = NULL;
+    if ((header->flags & BINARY_BOOK_GLYPH) != 0) {
+        if (header->glyph_size > INT_MAX ||
+            !valid_section(binary_book, header->glyph_unicode_offset, sizeof(uint32_t) * header->glyph_size) ||
+            !valid_section(binary_book, header->glyph_offset, sizeof(uint8_t[GLYPH_PACKED_SIZE]) * header->glyph_size)) {
+            ERR("コードブックが壊れています");
+            unmap_binary_book(binary_book);
+            return 0;
+        }
+        binary_book->atlas.size = header->glyph_size;
+        binary_book->atlas.unicode = (uint32_t *) ((uint8_t *) memory + header->glyph_unicode_offset);
+        binary_book->atlas.glyph = (uint8_t (*)[GLYPH_PACKED_SIZE]) ((uint8_t *) memory + header->glyph_offset);
+        if (!valid_atlas(&binary_book->atlas)) {
+            ERR("コードブックのグリフアトラスが壊れています");
+            unmap_binary_book(binary_book);
+            return 0;
+        }
+    }
+    if ((header->flags & BINARY_BOOK_FLAT_TABLE) != 0) {
+        if (!valid_section(binary_book, header->flat_table_offset, sizeof(flat_table_t))) {
+            ERR("コードブックが壊れています");
+            unmap_binary_book(binary_book);
+            return 0;
+        }
+        binary_book->flat_table = (flat_table_t *) ((uint8_t *) memory + header->flat_table_offset);
+        for (int c = 0; c < 256; c++) {
+            if (binary_book->flat_table->index[c] < 0 || binary_book->flat_table->index[c] >= size) {
+                ERR("コードブックの一様ベクトルの表が壊れています");
+                unmap_binary_book(binary_book);
+                return 0;
+            }
+        }
+    }
+    if ((header->flags & BINARY_BOOK_KD_TREE) == 0) {
+        return 1;
+    }
+    if (header->node_size < 1 ||
+        !valid_section(binary_book, header->node_offset, sizeof(kd_node_t) * header->node_size) ||
+        !valid_section(binary_book, header->order_offset, sizeof(int) * size) ||
+        !valid_section(binary_book, header->tree_code_offset, sizeof(uint8_t[CODE_SIZE]) * size)) {
+        ERR("コードブックが壊れています");
+        unmap_binary_book(binary_book);
+        return 0;
+    }
+    binary_book->node = (kd_node_t *) ((uint8_t *) memory + header->node_offset);
+    binary_book->order = (int *) ((uint8_t *) memory + header->order_offset);
+    binary_book->tree_code = (uint8_t (*)[CODE_SIZE]) ((uint8_t *) memory + header->tree_code_offset);
+    if (!valid_kd_tree(binary_book)) {
+        ERR("コードブックのkd木が壊れています");
+        unmap_binary_book(binary_book);
+        return 0;
+    }
+    return 1;
+}
+
+void map_binary_book_file(char *filename, binary_book_t *binary_book) {
+    if (!load_binary_book_file(filename, binary_book)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+void unmap_binary_book(binary_book_t *binary_book) {
+    munmap(binary_book->memory, binary_book->length);
+}
+
+// 各文字のベクトルと文字コードを1つの連続領域に並べた code_book_t を作る
+void binary_book_to_code_book(binary_book_t *binary_book, code_book_t *code_book) {
+    int size = binary_book->size;
+    code_book->size = size;
+    code_book->capacity = size;
+    code_book->code = xmalloc(sizeof(code_cell_t *) * size);
+    code_book->cell = xmalloc(sizeof(code_cell_t) * size);
+    for (int i = 0; i < size; i++) {
+        memcpy(code_book->cell[i].code, binary_book->code[i], CODE_SIZE);
+        code_book->cell[i].unicode = binary_book->unicode[i];
+        code_book->code[i] = &code_book->cell[i];
+    }
+}
+
+static void unique_code_book(code_book_t *code_book, code_book_t *unique) {
+    qsort(code_book->code, code_book->size, sizeof(code_cell_t *), compare_code);
+    init_code_book(unique);
+    for (int i = 0; i < code_book->size; i++) {
+        if (i > 0 && compare_code(&code_book->code[i - 1], &code_book->code[i]) == 0) {
+            continue;
+        }
+        add_code_book(unique, code_book->code[i]);
+    }
+}
+
+// data を書き出し、次の領域の位置として ARENA_ALIGN バイト境界まで0で埋めたオフセットを返す
+static uint64_t write_section(FILE *file, uint64_t offset, const void *data, size_t size) {
+    static const uint8_t zero[ARENA_ALIGN];
+    if (size > 0 && fwrite(data, size, 1, file) != 1) {
+        perror("");
+        exit(EXIT_FAILURE);
+    }
+    offset += size;
+    size_t padding = (ARENA_ALIGN - offset % ARENA_ALIGN) % ARENA_ALIGN;
+    if (padding > 0 && fwrite(zero, padding, 1, file) != 1) {
+        perror("");
+        exit(EXIT_FAILURE);
+    }
+    return offset + padding;
+}
+
+static int valid_section(binary_book_t *binary_book, uint64_t offset, size_t size) {
+    return offset % ARENA_ALIGN == 0 && offset <= binary_book->length && size <= binary_book->length - offset;
+}
+
+// 検索時に範囲外を参照しないよう、ノードの参照先と並び順がすべて範囲内にあることを確かめる
+static int valid_kd_tree(binary_book_t *binary_book) {
+    int size = binary_book->size;
+    int node_size = binary_book->header->node_size;
+    for (int i = 0; i < node_size; i++) {
+        kd_node_t *node = &binary_book->node[i];
+        if (node->dim >= CODE_SIZE) {
+            return 0;
+        }
+        if (node->dim >= 0 && (node->left <= i || node->left >= node_size || node->right <= i || node->right >= node_size)) {
+            return 0;
+        }
+        if (node->dim < 0 && (node->start < 0 || node->start > node->end || node->end > size)) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < size; i++) {
+        if (binary_book->order[i] < 0 || binary_book->order[i] >= size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 文字コードが昇順 (重複なし) に並んでいることを確かめる
+static int valid_atlas(glyph_atlas_t *atlas) {
+    for (int i = 1; i < atlas->size; i++) {
+        if (atlas->unicode[i - 1] >= atlas->unicode[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
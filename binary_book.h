@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef BINARY_BOOK_H
+#define BINARY_BOOK_H
+
+#include "common.h"
+#include "flat_book.h"
+#include "kd_tree.h"
+#include "flat_table.h"
+
+#define BINARY_BOOK_MAGIC "P2AABOOK"
+#define BINARY_BOOK_VERSION 1
+#define BINARY_BOOK_BYTE_ORDER 0x01020304
+#define BINARY_BOOK_KD_TREE 0x1
+#define BINARY_BOOK_FLAT_TABLE 0x2
+#define BINARY_BOOK_GLYPH 0x4
+
+// バイナリ形式のコードブックのヘッダ。各領域はファイル先頭からのオフセットで示し、ARENA_ALIGN バイト境界に置く
+// code: CODE_STRIDE バイトに0埋めしたベクトル (size + 1 件、最後は0), unicode: uint32_t の文字コード
+// BINARY_BOOK_FLAT_TABLE の場合は一様ベクトルの表、BINARY_BOOK_KD_TREE の場合は kd木のノード、並び順、複製したベクトルも持つ
+// BINARY_BOOK_GLYPH の場合はグリフアトラスも持つ。追加の項目は以前の形式では0埋めの余白だった位置にあり、以前のファイルもそのまま読める
+typedef struct binary_book_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t size;
+    uint32_t code_stride;
+    uint32_t flags;
+    uint32_t node_size;
+    uint64_t code_offset;
+    uint64_t unicode_offset;
+    uint64_t node_offset;
+    uint64_t order_offset;
+    uint64_t tree_code_offset;
+    uint64_t flat_table_offset;
+    uint64_t glyph_size;
+    uint64_t glyph_unicode_offset;
+    uint64_t glyph_offset;
+} binary_book_header_t;
+
+// フォントから展開した全角文字のグリフ。unicode は昇順で、glyph は GLYPH_PACKED_SIZE バイトに詰めたもの (0: 黒, 1: 白)
+// ベクトルの重複を除く前のすべての文字を持つため、同じフォントから作ったどのAAも描画できる
+typedef struct glyph_atlas_t {
+    int size;
+    uint32_t *unicode;
+    uint8_t (*glyph)[GLYPH_PACKED_SIZE];
+} glyph_atlas_t;
+
+// mmap したバイナリ形式のコードブック。各ポインタはマップした領域をそのまま指す
+typedef struct binary_book_t {
+    void *memory;
+    size_t length;
+    binary_book_header_t *header;
+    int size;
+    uint8_t (*code)[CODE_STRIDE];
+    uint32_t *unicode;
+    kd_node_t *node;
+    int *order;
+    uint8_t (*tree_code)[CODE_SIZE];
+    flat_table_t *flat_table;
+    glyph_atlas_t atlas;
+} binary_book_t;
+
+// is_binary_book_file, map_binary_book_file は失敗すると終了する。check_*, load_* は 0 を返す
+int is_binary_book_file(char *filename);
+int check_binary_book_file(char *filename, int *binary);
+void write_binary_book_file(char *filename, code_book_t *code_book, int with_kd_tree, glyph_atlas_t *atlas);
+void map_binary_book_file(char *filename, binary_book_t *binary_book);
+int load_binary_book_file(char *filename, binary_book_t *binary_book);
+void unmap_binary_book(binary_book_t *binary_book);
+void binary_book_to_code_book(binary_book_t *binary_book, code_book_t *code_book);
+
+#endif //BINARY_BOOK_H
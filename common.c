@@ -5,8 +5,20 @@
  * http://opensource.org/licenses/MIT
  */
 
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include "common.h"
 
+// CPU数が取得できない場合のスレッド数
+#define DEFAULT_THREAD_NUM 4
+
+// -j を指定しない場合のスレッド数。オンラインのCPU数を使う
+int default_thread_num(void) {
+    long cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpu > 0 ? (int) cpu : DEFAULT_THREAD_NUM;
+}
+
 void *xmalloc(size_t n) {
     void *p = malloc(n);
     if (p == NULL) {
@@ -25,15 +37,118 @@ void *xrealloc(void *ptr, size_t size) {
     return p;
 }
 
+void *xmalloc_aligned(size_t alignment, size_t n) {
+    void *p = NULL;
+    int error = posix_memalign(&p, alignment, n);
+    if (error != 0) {
+        errno = error;
+        perror("");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// 切り出す領域はすべて ARENA_ALIGN バイト境界に揃える
+void init_arena(arena_t *arena, size_t size) {
+    arena->size = size;
+    arena->used = 0;
+    arena->memory = xmalloc_aligned(ARENA_ALIGN, size > 0 ? size : 1);
+}
+
+void *arena_alloc(arena_t *arena, size_t n) {
+    size_t size = (n + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (size > arena->size - arena->used) {
+        ERR("アリーナの容量が不足しています");
+        exit(EXIT_FAILURE);
+    }
+    void *p = arena->memory + arena->used;
+    arena->used += size;
+    return p;
+}
+
+void free_arena(arena_t *arena) {
+    free(arena->memory);
+    arena->memory = NULL;
+}
+
+void init_image(image_t *image, int width, int height, image_layout_t layout) {
+    image->width = width;
+    image->height = height;
+    image->layout = layout;
+    image->block_width = width / CODE_WIDTH;
+    image->block_height = height / CODE_WIDTH;
+    image->map = NULL;
+    image->block = NULL;
+    if (layout == IMAGE_BLOCK_MAJOR) {
+        size_t size = sizeof(uint8_t[CODE_STRIDE]) * image->block_width * image->block_height;
+        init_arena(&image->arena, size + ARENA_ALIGN);
+        image->block = arena_alloc(&image->arena, size);
+        memset(image->block, 0, size);
+        return;
+    }
+    size_t pointer_size = sizeof(uint8_t *) * height;
+    size_t pixel_size = sizeof(uint8_t) * width * height;
+    init_arena(&image->arena, pointer_size + pixel_size + ARENA_ALIGN * 2);
+    image->map = arena_alloc(&image->arena, pointer_size);
+    uint8_t *pixel = arena_alloc(&image->arena, pixel_size);
+    for (int y = 0; y < height; y++) {
+        image->map[y] = pixel + (size_t) width * y;
+    }
+}
+
+void free_image(image_t *image) {
+    free_arena(&image->arena);
+    image->map = NULL;
+    image->block = NULL;
+}
+
+// (x, y) のブロックの9画素を sample に読み出す。sample は CODE_STRIDE バイトで、余白は0になる
+void load_sample(image_t *image, int x, int y, uint8_t *sample) {
+    if (image->layout == IMAGE_BLOCK_MAJOR) {
+        memcpy(sample, image->block[y * image->block_width + x], CODE_STRIDE);
+        return;
+    }
+    memset(sample, 0, CODE_STRIDE);
+    for (int cy = 0; cy < CODE_WIDTH; cy++) {
+        uint8_t *row = image->map[y * CODE_WIDTH + cy] + x * CODE_WIDTH;
+        for (int cx = 0; cx < CODE_WIDTH; cx++) {
+            sample[cy * CODE_WIDTH + cx] = row[cx];
+        }
+    }
+}
+
+void init_aa(aa_t *aa, int width, int height) {
+    aa->width = width;
+    aa->height = height;
+    size_t pointer_size = sizeof(uint32_t *) * height;
+    size_t cell_size = sizeof(uint32_t) * width * height;
+    init_arena(&aa->arena, pointer_size + cell_size + ARENA_ALIGN * 2);
+    aa->map = arena_alloc(&aa->arena, pointer_size);
+    uint32_t *cell = arena_alloc(&aa->arena, cell_size);
+    for (int y = 0; y < height; y++) {
+        aa->map[y] = cell + (size_t) width * y;
+    }
+}
+
+void free_aa(aa_t *aa) {
+    free_arena(&aa->arena);
+    aa->map = NULL;
+}
+
 void init_code_book(code_book_t *code_book) {
     code_book->size = 0;
     code_book->capacity = 8;
     code_book->code = xmalloc(sizeof(code_cell_t *) * 8);
+    code_book->cell = NULL;
 }
 
 void free_code_book(code_book_t *code_book) {
-    for (int i = 0; i < code_book->size; ++i) {
-        free(code_book->code[i]);
+    if (code_book->cell != NULL) {
+        free(code_book->cell);
+    } else {
+        for (int i = 0; i < code_book->size; ++i) {
+            free(code_book->code[i]);
+        }
     }
     free(code_book->code);
 }
@@ -47,22 +162,27 @@ void add_code_book(code_book_t *code_book, code_cell_t *code_cell) {
 }
 
 void print_unicode_as_utf8(FILE *file, uint32_t unicode) {
+    char c[3];
+    int size = write_unicode_as_utf8(c, unicode);
+    fwrite(c, sizeof(char), size, file);
+}
+
+// c に最大3バイト書き込み、書き込んだバイト数を返す
+int write_unicode_as_utf8(char *c, uint32_t unicode) {
     if (unicode < 0x80) {
-        char c[1];
         c[0] = unicode & 0xff;
-        fwrite(c, sizeof(char), 1, file);
+        return 1;
     } else if (unicode < 0x800) {
-        char c[2];
         c[0] = 0xc0 | (unicode >> 6 & 0x1f);
         c[1] = 0x80 | (unicode & 0x3f);
-        fwrite(c, sizeof(char), 2, file);
+        return 2;
     } else if (unicode < 0x10000) {
-        char c[3];
         c[0] = 0xe0 | (unicode >> 12 & 0xf);
         c[1] = 0x80 | (unicode >> 6 & 0x3f);
         c[2] = 0x80 | (unicode & 0x3f);
-        fwrite(c, sizeof(char), 3, file);
+        return 3;
     }
+    return 0;
 }
 
 uint32_t read_utf8_as_unicode(const char *c, int *count) {
@@ -86,3 +206,118 @@ uint32_t read_utf8_as_unicode(const char *c, int *count) {
     }
     return unicode;
 }
+
+int calculate_distance(uint8_t *a, uint8_t *b) {
+    int distance = 0;
+    for (int i = 0; i < CODE_SIZE; i++) {
+        distance += abs(a[i] - b[i]);
+    }
+    return distance;
+}
+
+// 1行分ごとに途中の和を確認し、bound を超えた時点で打ち切る
+// 打ち切った場合は bound より大きい途中の値を返す。count が NULL でなければ計算した行数などを加算する
+int calculate_distance_bounded(uint8_t *a, uint8_t *b, int bound, distance_count_t *count) {
+    int distance = 0;
+    int y = 0;
+    while (y < CODE_WIDTH) {
+        for (int x = 0; x < CODE_WIDTH; x++) {
+            int i = y * CODE_WIDTH + x;
+            distance += abs(a[i] - b[i]);
+        }
+        y++;
+        if (distance > bound) {
+            break;
+        }
+    }
+    if (count != NULL) {
+        if (y < CODE_WIDTH) {
+            count->abandoned++;
+        } else {
+            count->complete++;
+        }
+        count->rows += y;
+    }
+    return distance;
+}
+
+// 打ち切らずに計算した距離 n 回分を加算する
+void add_full_distance(distance_count_t *count, long n) {
+    count->complete += n;
+    count->rows += n * CODE_WIDTH;
+}
+
+void read_code_book_file(char *filename, code_book_t *code_book) {
+    if (!load_code_book_file(filename, code_book)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// ファイルを開けない場合はメッセージを表示して 0 を返す
+int load_code_book_file(char *filename, code_book_t *code_book) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror(filename);
+        return 0;
+    }
+    read_code_book_stream(file, code_book);
+    fclose(file);
+    return 1;
+}
+
+void read_code_book_stream(FILE *file, code_book_t *code_book) {
+    char string[100];
+    int code[CODE_SIZE];
+    while (fscanf(file, "%x,%x,%x,%x,%x,%x,%x,%x,%x,%s",
+                  &code[0], &code[1], &code[2],
+                  &code[3], &code[4], &code[5],
+                  &code[6], &code[7], &code[8],
+                  string
+    ) == 10) {
+        code_cell_t *cell = xmalloc(sizeof(code_cell_t));
+        for (int i = 0; i < CODE_SIZE; i++) {
+            cell->code[i] = code[i];
+        }
+        cell->unicode = read_utf8_as_unicode(string, NULL);
+        add_code_book(code_book, cell);
+    }
+}
+
+int compare_code(const void *a, const void *b) {
+    code_cell_t *ac = *(code_cell_t **) a;
+    code_cell_t *bc = *(code_cell_t **) b;
+    int total = 0;
+    for (int i = 0; i < CODE_SIZE; i++) {
+        total += ac->code[i] - bc->code[i];
+    }
+    if (total != 0) {
+        return total;
+    }
+    for (int i = 0; i < CODE_SIZE; i++) {
+        int diff = ac->code[i] - bc->code[i];
+        if (diff != 0) {
+            return diff;
+        }
+    }
+    return 0;
+}
+
+void print_code_book(FILE *file, code_book_t *code_book) {
+    qsort(code_book->code, code_book->size, sizeof(code_cell_t *), compare_code);
+    code_cell_t *last_cell = NULL;
+    for (int i = 0; i < code_book->size; i++) {
+        code_cell_t *code_cell = code_book->code[i];
+        if (last_cell == NULL || compare_code(&last_cell, &code_cell) != 0) {
+            if (last_cell != NULL) {
+                fprintf(file, "\n");
+            }
+            for (int j = 0; j < CODE_SIZE; j++) {
+                fprintf(file, "%02x,", code_cell->code[j]);
+            }
+        }
+        last_cell = code_cell;
+        print_unicode_as_utf8(file, code_cell->unicode);
+        // fprintf(file, " %04x ", code_cell->unicode);
+    }
+    fprintf(file, "\n");
+}
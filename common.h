@@ -13,9 +13,14 @@
 #include <stdint.h>
 
 #define FONT_WIDTH 16
+// 1画素1ビット (上位ビットが左) に詰めたグリフの1行と全体のバイト数
+#define GLYPH_PACKED_ROW (FONT_WIDTH / 8)
+#define GLYPH_PACKED_SIZE (GLYPH_PACKED_ROW * FONT_WIDTH)
 #define CODE_WIDTH 3
 #define CODE_SIZE (CODE_WIDTH * CODE_WIDTH)
 #define CELL_WIDTH 5
+#define CODE_STRIDE 16
+#define ARENA_ALIGN 64
 
 #define _DEBUG_
 
@@ -36,30 +41,79 @@ typedef struct code_cell_t {
     uint32_t unicode;
 } code_cell_t;
 
+// cell が NULL でない場合、各要素は cell にまとめて確保されている
 typedef struct code_book_t {
     code_cell_t **code;
     int size;
     int capacity;
+    code_cell_t *cell;
 } code_book_t;
 
+// 一度に確保した連続領域から、先頭から順に切り出して使う。解放は全体をまとめて行う
+typedef struct arena_t {
+    uint8_t *memory;
+    size_t size;
+    size_t used;
+} arena_t;
+
+// 打ち切り付きの距離計算の集計。complete: 最後の行まで計算した回数、abandoned: 途中で打ち切った回数、rows: 加算した行数
+typedef struct distance_count_t {
+    long complete;
+    long abandoned;
+    long rows;
+} distance_count_t;
+
 typedef struct aa_t {
     int width;
     int height;
     uint32_t **map;
+    arena_t arena;
 } aa_t;
 
+// IMAGE_ROW_MAJOR: map[y][x] で画素を参照する
+// IMAGE_BLOCK_MAJOR: CODE_WIDTH x CODE_WIDTH のブロックの9画素を CODE_STRIDE バイトに詰めて連続に並べる
+// ブロックに満たない右端と下端の画素は持たない。map は NULL になる
+typedef enum image_layout_t {
+    IMAGE_ROW_MAJOR,
+    IMAGE_BLOCK_MAJOR,
+} image_layout_t;
+
 typedef struct image_t {
     int width;
     int height;
     uint8_t **map;
+    image_layout_t layout;
+    int block_width;
+    int block_height;
+    uint8_t (*block)[CODE_STRIDE];
+    arena_t arena;
 } image_t;
 
+int default_thread_num(void);
 void *xmalloc(size_t n);
 void *xrealloc(void *ptr, size_t size);
+void *xmalloc_aligned(size_t alignment, size_t n);
+void init_arena(arena_t *arena, size_t size);
+void *arena_alloc(arena_t *arena, size_t n);
+void free_arena(arena_t *arena);
+void init_image(image_t *image, int width, int height, image_layout_t layout);
+void free_image(image_t *image);
+void load_sample(image_t *image, int x, int y, uint8_t *sample);
+void init_aa(aa_t *aa, int width, int height);
+void free_aa(aa_t *aa);
 void init_code_book(code_book_t *code_book);
 void free_code_book(code_book_t *code_book);
 void add_code_book(code_book_t *code_book, code_cell_t *code_cell);
+void read_code_book_file(char *filename, code_book_t *code_book);
+int load_code_book_file(char *filename, code_book_t *code_book);
+void read_code_book_stream(FILE *file, code_book_t *code_book);
+int compare_code(const void *a, const void *b);
+void print_code_book(FILE *file, code_book_t *code_book);
 void print_unicode_as_utf8(FILE *file, uint32_t unicode);
+int write_unicode_as_utf8(char *c, uint32_t unicode);
 uint32_t read_utf8_as_unicode(const char *c, int *count);
+int calculate_distance(uint8_t *a, uint8_t *b);
+int calculate_distance_bounded(uint8_t *a, uint8_t *b, int bound, distance_count_t *count);
+void add_full_distance(distance_count_t *count, long n);
 
 #endif //COMMON_H
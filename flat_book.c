@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include "flat_book.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNEL
+#include <immintrin.h>
+#endif
+
+// count 件の中から *min より距離が小さいものを探し、最初に見つかった最小のものの位置を返す
+// 見つからなければ -1 を返す。同距離なら位置の小さい方を優先するため、総当たりと同じ結果になる
+typedef int (*argmin_kernel_t)(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min);
+
+typedef struct distance_kernel_t {
+    const char *name;
+    argmin_kernel_t argmin;
+    int (*supported)(void);
+} distance_kernel_t;
+
+static int argmin_scalar(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min);
+static int reduce_lanes(int *lane_min, int *lane_index, int lanes, int *min);
+static int always_supported(void);
+#ifdef X86_KERNEL
+static int argmin_sse2(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min);
+static int argmin_avx2(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min);
+static int argmin_avx512(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min);
+static int sse2_supported(void);
+static int avx2_supported(void);
+static int avx512_supported(void);
+#endif
+
+// 性能の高い順に並べる
+static const distance_kernel_t kernels[] = {
+#ifdef X86_KERNEL
+        {"avx512", argmin_avx512, avx512_supported},
+        {"avx2", argmin_avx2, avx2_supported},
+        {"sse2", argmin_sse2, sse2_supported},
+#endif
+        {"scalar", argmin_scalar, always_supported},
+};
+
+// select_distance_kernel で指定されていなければ、最初に使うときに1度だけ既定のものを選ぶ
+static const distance_kernel_t *current_kernel = NULL;
+static pthread_once_t default_kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_default_kernel(void);
+
+void init_flat_book(flat_book_t *flat_book, code_book_t *code_book) {
+    flat_book->size = code_book->size;
+    flat_book->mapped = 0;
+    flat_book->code = xmalloc_aligned(FLAT_BOOK_ALIGN, sizeof(uint8_t[CODE_STRIDE]) * (code_book->size + 1));
+    memset(flat_book->code, 0, sizeof(uint8_t[CODE_STRIDE]) * (code_book->size + 1));
+    for (int i = 0; i < code_book->size; i++) {
+        memcpy(flat_book->code[i], code_book->code[i]->code, CODE_SIZE);
+    }
+}
+
+// code は size + 1 件あり、最後は0で埋められている必要がある
+void map_flat_book(flat_book_t *flat_book, uint8_t (*code)[CODE_STRIDE], int size) {
+    flat_book->size = size;
+    flat_book->code = code;
+    flat_book->mapped = 1;
+}
+
+void free_flat_book(flat_book_t *flat_book) {
+    if (!flat_book->mapped) {
+        free(flat_book->code);
+    }
+}
+
+int select_distance_kernel(const char *name) {
+    int count = sizeof(kernels) / sizeof(kernels[0]);
+    for (int i = 0; i < count; i++) {
+        if ((name == NULL || strcmp(name, "auto") == 0) && kernels[i].supported()) {
+            current_kernel = &kernels[i];
+            return 1;
+        }
+        if (name != NULL && strcmp(name, kernels[i].name) == 0) {
+            if (!kernels[i].supported()) {
+                return 0;
+            }
+            current_kernel = &kernels[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 検索スレッドを起動する前に呼んでおけば、スレッドから current_kernel に書き込むことは無い
+void init_distance_kernel(void) {
+    pthread_once(&default_kernel_once, select_default_kernel);
+}
+
+static void select_default_kernel(void) {
+    if (current_kernel == NULL) {
+        select_distance_kernel(NULL);
+    }
+}
+
+const char *distance_kernel_name(void) {
+    if (current_kernel == NULL) {
+        init_distance_kernel();
+    }
+    return current_kernel->name;
+}
+
+void pad_sample(uint8_t *padded, uint8_t *sample) {
+    memset(padded, 0, CODE_STRIDE);
+    memcpy(padded, sample, CODE_SIZE);
+}
+
+int argmin_distance(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min) {
+    if (current_kernel == NULL) {
+        init_distance_kernel();
+    }
+    return current_kernel->argmin(padded, code, count, min);
+}
+
+int search_flat_book(flat_book_t *flat_book, uint8_t *sample) {
+    uint8_t padded[CODE_STRIDE];
+    pad_sample(padded, sample);
+    int min = INT_MAX;
+    int index = argmin_distance(padded, flat_book->code, flat_book->size, &min);
+    return index < 0 ? 0 : index;
+}
+
+static int argmin_scalar(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min) {
+    int index = -1;
+    for (int i = 0; i < count; i++) {
+        int d = calculate_distance(padded, code[i]);
+        if (*min > d) {
+            *min = d;
+            index = i;
+        }
+    }
+    return index;
+}
+
+static int reduce_lanes(int *lane_min, int *lane_index, int lanes, int *min) {
+    int index = -1;
+    int best = *min;
+    for (int i = 0; i < lanes; i++) {
+        if (lane_index[i] < 0) {
+            continue;
+        }
+        if (best > lane_min[i] || (best == lane_min[i] && index > lane_index[i])) {
+            best = lane_min[i];
+            index = lane_index[i];
+        }
+    }
+    *min = best;
+    return index;
+}
+
+static int always_supported(void) {
+    return 1;
+}
+
+#ifdef X86_KERNEL
+
+static int sse2_supported(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+static int avx2_supported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static int avx512_supported(void) {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+// psadbw は8バイトごとの差の絶対値の和を64bitずつ返す
+// 4件分の結果を32bitずつ詰め直し、上位と下位の和を取って各レーンの距離にする
+__attribute__((target("sse2")))
+static int argmin_sse2(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min) {
+    __m128i s = _mm_loadu_si128((const __m128i *) padded);
+    __m128i lane_min = _mm_set1_epi32(INT_MAX);
+    __m128i lane_index = _mm_set1_epi32(-1);
+    __m128i current = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i step = _mm_set1_epi32(4);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i r0 = _mm_sad_epu8(s, _mm_loadu_si128((const __m128i *) code[i]));
+        __m128i r1 = _mm_sad_epu8(s, _mm_loadu_si128((const __m128i *) code[i + 1]));
+        __m128i r2 = _mm_sad_epu8(s, _mm_loadu_si128((const __m128i *) code[i + 2]));
+        __m128i r3 = _mm_sad_epu8(s, _mm_loadu_si128((const __m128i *) code[i + 3]));
+        __m128i u = _mm_or_si128(r0, _mm_slli_si128(r1, 4));
+        __m128i v = _mm_or_si128(r2, _mm_slli_si128(r3, 4));
+        __m128i d = _mm_add_epi32(_mm_unpacklo_epi64(u, v), _mm_unpackhi_epi64(u, v));
+        __m128i mask = _mm_cmpgt_epi32(lane_min, d);
+        lane_min = _mm_or_si128(_mm_and_si128(mask, d), _mm_andnot_si128(mask, lane_min));
+        lane_index = _mm_or_si128(_mm_and_si128(mask, current), _mm_andnot_si128(mask, lane_index));
+        current = _mm_add_epi32(current, step);
+    }
+    int lane_min_array[4];
+    int lane_index_array[4];
+    _mm_storeu_si128((__m128i *) lane_min_array, lane_min);
+    _mm_storeu_si128((__m128i *) lane_index_array, lane_index);
+    int index = reduce_lanes(lane_min_array, lane_index_array, 4, min);
+    int tail = argmin_scalar(padded, code + i, count - i, min);
+    return tail < 0 ? index : i + tail;
+}
+
+// 1回のロードで2件を読み、各128bitレーンに [0,2,4,6] [1,3,5,7] 番目の距離が並ぶ
+__attribute__((target("avx2")))
+static int argmin_avx2(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min) {
+    __m256i s = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) padded));
+    __m256i lane_min = _mm256_set1_epi32(INT_MAX);
+    __m256i lane_index = _mm256_set1_epi32(-1);
+    __m256i current = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i step = _mm256_set1_epi32(8);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i r0 = _mm256_sad_epu8(s, _mm256_loadu_si256((const __m256i *) code[i]));
+        __m256i r1 = _mm256_sad_epu8(s, _mm256_loadu_si256((const __m256i *) code[i + 2]));
+        __m256i r2 = _mm256_sad_epu8(s, _mm256_loadu_si256((const __m256i *) code[i + 4]));
+        __m256i r3 = _mm256_sad_epu8(s, _mm256_loadu_si256((const __m256i *) code[i + 6]));
+        __m256i u = _mm256_or_si256(r0, _mm256_slli_si256(r1, 4));
+        __m256i v = _mm256_or_si256(r2, _mm256_slli_si256(r3, 4));
+        __m256i d = _mm256_add_epi32(_mm256_unpacklo_epi64(u, v), _mm256_unpackhi_epi64(u, v));
+        __m256i mask = _mm256_cmpgt_epi32(lane_min, d);
+        lane_min = _mm256_min_epi32(lane_min, d);
+        lane_index = _mm256_blendv_epi8(lane_index, current, mask);
+        current = _mm256_add_epi32(current, step);
+    }
+    int lane_min_array[8];
+    int lane_index_array[8];
+    _mm256_storeu_si256((__m256i *) lane_min_array, lane_min);
+    _mm256_storeu_si256((__m256i *) lane_index_array, lane_index);
+    int index = reduce_lanes(lane_min_array, lane_index_array, 8, min);
+    int tail = argmin_sse2(padded, code + i, count - i, min);
+    return tail < 0 ? index : i + tail;
+}
+
+// 1回のロードで4件を読み、各128bitレーン k に k, k+4, k+8, k+12 番目の距離が並ぶ
+__attribute__((target("avx512f,avx512bw")))
+static int argmin_avx512(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min) {
+    __m512i s = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) padded));
+    __m512i lane_min = _mm512_set1_epi32(INT_MAX);
+    __m512i lane_index = _mm512_set1_epi32(-1);
+    __m512i current = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    __m512i step = _mm512_set1_epi32(16);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i r0 = _mm512_sad_epu8(s, _mm512_loadu_si512(code[i]));
+        __m512i r1 = _mm512_sad_epu8(s, _mm512_loadu_si512(code[i + 4]));
+        __m512i r2 = _mm512_sad_epu8(s, _mm512_loadu_si512(code[i + 8]));
+        __m512i r3 = _mm512_sad_epu8(s, _mm512_loadu_si512(code[i + 12]));
+        __m512i u = _mm512_or_si512(r0, _mm512_bslli_epi128(r1, 4));
+        __m512i v = _mm512_or_si512(r2, _mm512_bslli_epi128(r3, 4));
+        __m512i d = _mm512_add_epi32(_mm512_unpacklo_epi64(u, v), _mm512_unpackhi_epi64(u, v));
+        __mmask16 mask = _mm512_cmpgt_epi32_mask(lane_min, d);
+        lane_min = _mm512_mask_mov_epi32(lane_min, mask, d);
+        lane_index = _mm512_mask_mov_epi32(lane_index, mask, current);
+        current = _mm512_add_epi32(current, step);
+    }
+    int lane_min_array[16];
+    int lane_index_array[16];
+    _mm512_storeu_si512(lane_min_array, lane_min);
+    _mm512_storeu_si512(lane_index_array, lane_index);
+    int index = reduce_lanes(lane_min_array, lane_index_array, 16, min);
+    int tail = argmin_avx2(padded, code + i, count - i, min);
+    return tail < 0 ? index : i + tail;
+}
+
+#endif
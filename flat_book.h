@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef FLAT_BOOK_H
+#define FLAT_BOOK_H
+
+#include "common.h"
+
+#define FLAT_BOOK_ALIGN ARENA_ALIGN
+
+// コードブックのベクトルを16バイト境界に揃えて連続領域に並べたもの
+// 余白は0で埋めるため、同じく0で埋めたサンプルとの距離には影響しない
+// mapped の場合、code はバイナリ形式のコードブックをマップした領域を指し、解放しない
+typedef struct flat_book_t {
+    int size;
+    uint8_t (*code)[CODE_STRIDE];
+    int mapped;
+} flat_book_t;
+
+void init_flat_book(flat_book_t *flat_book, code_book_t *code_book);
+void map_flat_book(flat_book_t *flat_book, uint8_t (*code)[CODE_STRIDE], int size);
+void free_flat_book(flat_book_t *flat_book);
+int select_distance_kernel(const char *name);
+void init_distance_kernel(void);
+const char *distance_kernel_name(void);
+void pad_sample(uint8_t *padded, uint8_t *sample);
+int argmin_distance(uint8_t *padded, uint8_t (*code)[CODE_STRIDE], int count, int *min);
+int search_flat_book(flat_book_t *flat_book, uint8_t *sample);
+
+#endif //FLAT_BOOK_H
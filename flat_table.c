@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <limits.h>
+#include <string.h>
+#include "flat_table.h"
+
+void init_flat_table(flat_table_t *flat_table, code_book_t *code_book) {
+    uint8_t uniform[CODE_SIZE];
+    for (int c = 0; c < 256; c++) {
+        memset(uniform, c, sizeof(uniform));
+        int min = INT_MAX;
+        int second = INT_MAX;
+        int index = 0;
+        for (int i = 0; i < code_book->size; i++) {
+            int d = calculate_distance(uniform, code_book->code[i]->code);
+            if (min > d) {
+                second = min;
+                min = d;
+                index = i;
+            } else if (second > d) {
+                second = d;
+            }
+        }
+        flat_table->index[c] = index;
+        flat_table->margin[c] = second == INT_MAX ? INT_MAX : second - min;
+    }
+}
+
+// 表から正確な結果が得られた場合は1を返す。判断できない場合は0を返すので、通常の検索を行う
+int lookup_flat_table(flat_table_t *flat_table, uint8_t *sample, int *index) {
+    int sum = 0;
+    for (int i = 0; i < CODE_SIZE; i++) {
+        sum += sample[i];
+    }
+    int c = (sum + CODE_SIZE / 2) / CODE_SIZE;
+    int delta = 0;
+    for (int i = 0; i < CODE_SIZE; i++) {
+        delta += abs(sample[i] - c);
+    }
+    if (delta != 0 && 2 * delta >= flat_table->margin[c]) {
+        return 0;
+    }
+    *index = flat_table->index[c];
+    return 1;
+}
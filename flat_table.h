@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef FLAT_TABLE_H
+#define FLAT_TABLE_H
+
+#include "common.h"
+
+// 9要素がすべて同じ値 c のサンプルに対する検索結果の表
+// margin は c に対する最近傍と、それ以外で最も近いものとの距離の差
+// サンプル x と一様ベクトル c のL1距離を δ とすると、三角不等式より 2δ < margin なら最近傍は変わらない
+typedef struct flat_table_t {
+    int index[256];
+    int margin[256];
+} flat_table_t;
+
+void init_flat_table(flat_table_t *flat_table, code_book_t *code_book);
+int lookup_flat_table(flat_table_t *flat_table, uint8_t *sample, int *index);
+
+#endif //FLAT_TABLE_H
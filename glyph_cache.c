@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <string.h>
+#include "glyph_cache.h"
+
+static int find_strike_index(FT_Face face);
+static int expand_glyph(FT_Face face, uint32_t unicode, uint8_t *tile, uint8_t *packed);
+static void unpack_glyph(const uint8_t *packed, uint8_t *tile);
+
+int init_glyph_cache(glyph_cache_t *cache, const char *font_file) {
+    if (FT_Init_FreeType(&cache->library) != 0) {
+        ERR("FreeTypeを初期化できません");
+        return 0;
+    }
+    if (FT_New_Face(cache->library, font_file, 0, &cache->face) != 0) {
+        ERR("フォントが読み込めません: %s", font_file);
+        FT_Done_FreeType(cache->library);
+        return 0;
+    }
+    int strike_index = find_strike_index(cache->face);
+    if (strike_index < 0) {
+        ERR("対象サイズが見つかりません");
+        FT_Done_Face(cache->face);
+        FT_Done_FreeType(cache->library);
+        return 0;
+    }
+    FT_Select_Size(cache->face, strike_index);
+    cache->slot = xmalloc(sizeof(int) * GLYPH_CODE_MAX);
+    for (int i = 0; i < GLYPH_CODE_MAX; i++) {
+        cache->slot[i] = -1;
+    }
+    cache->size = 0;
+    cache->capacity = 256;
+    cache->tile = xmalloc(sizeof(uint8_t[GLYPH_TILE_SIZE]) * cache->capacity);
+    cache->packed = xmalloc(sizeof(uint8_t[GLYPH_PACKED_SIZE]) * cache->capacity);
+    cache->mapped = 0;
+    return 1;
+}
+
+// アトラスのグリフをすべて登録する。フォントは開かないため、アトラスに無い文字は読み込めない
+int init_atlas_glyph_cache(glyph_cache_t *cache, glyph_atlas_t *atlas) {
+    cache->library = NULL;
+    cache->face = NULL;
+    cache->slot = xmalloc(sizeof(int) * GLYPH_CODE_MAX);
+    for (int i = 0; i < GLYPH_CODE_MAX; i++) {
+        cache->slot[i] = -1;
+    }
+    cache->size = atlas->size;
+    cache->capacity = atlas->size > 0 ? atlas->size : 1;
+    cache->packed = atlas->glyph;
+    cache->mapped = 1;
+    cache->tile = xmalloc(sizeof(uint8_t[GLYPH_TILE_SIZE]) * cache->capacity);
+    for (int i = 0; i < atlas->size; i++) {
+        if (atlas->unicode[i] >= GLYPH_CODE_MAX) {
+            ERR("対応していない文字です: U+%X", atlas->unicode[i]);
+            free_glyph_cache(cache);
+            return 0;
+        }
+        cache->slot[atlas->unicode[i]] = i;
+        unpack_glyph(cache->packed[i], cache->tile[i]);
+    }
+    return 1;
+}
+
+// コードブックの全文字のグリフを先に読み込む。描画は複数スレッドから行うため、途中で読み込むことはできない
+// グリフアトラスを含むバイナリ形式のコードブックであればフォントを開かずにそれを使う
+// それ以外の場合は font_file を開く。font_file が NULL ならグリフアトラスが必要
+int load_code_book_glyphs(glyph_cache_t *cache, code_book_t *code_book, binary_book_t *binary_book, const char *font_file) {
+    if (binary_book != NULL && (binary_book->header->flags & BINARY_BOOK_GLYPH) != 0) {
+        if (!init_atlas_glyph_cache(cache, &binary_book->atlas)) {
+            return 0;
+        }
+    } else if (font_file == NULL) {
+        ERR("コードブックにグリフアトラスがありません");
+        return 0;
+    } else if (!init_glyph_cache(cache, font_file)) {
+        return 0;
+    }
+    for (int i = 0; i < code_book->size; i++) {
+        if (load_glyph(cache, code_book->code[i]->unicode) < 0) {
+            free_glyph_cache(cache);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void free_glyph_cache(glyph_cache_t *cache) {
+    if (cache->face != NULL) {
+        FT_Done_Face(cache->face);
+        FT_Done_FreeType(cache->library);
+    }
+    free(cache->slot);
+    free(cache->tile);
+    if (!cache->mapped) {
+        free(cache->packed);
+    }
+}
+
+// 未読み込みの文字であればグリフを展開して登録し、その位置を返す。読み込めない文字であれば -1 を返す
+int load_glyph(glyph_cache_t *cache, uint32_t unicode) {
+    if (unicode >= GLYPH_CODE_MAX) {
+        ERR("対応していない文字です: U+%X", unicode);
+        return -1;
+    }
+    if (cache->slot[unicode] >= 0) {
+        return cache->slot[unicode];
+    }
+    if (cache->face == NULL) {
+        ERR("グリフアトラスに無い文字です: U+%X", unicode);
+        return -1;
+    }
+    if (cache->size == cache->capacity) {
+        cache->capacity *= 2;
+        cache->tile = xrealloc(cache->tile, sizeof(uint8_t[GLYPH_TILE_SIZE]) * cache->capacity);
+        cache->packed = xrealloc(cache->packed, sizeof(uint8_t[GLYPH_PACKED_SIZE]) * cache->capacity);
+    }
+    if (!expand_glyph(cache->face, unicode, cache->tile[cache->size], cache->packed[cache->size])) {
+        return -1;
+    }
+    cache->slot[unicode] = cache->size;
+    return cache->size++;
+}
+
+int load_aa_glyphs(glyph_cache_t *cache, aa_t *aa) {
+    for (int y = 0; y < aa->height; y++) {
+        for (int x = 0; x < aa->width; x++) {
+            if (load_glyph(cache, aa->map[y][x]) < 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// width 文字分のグリフを FONT_WIDTH 画素行に並べる。bit_depth が1なら1画素1ビットに詰めて書き込む
+void render_glyph_row(glyph_cache_t *cache, const uint32_t *unicode, int width, int bit_depth, uint8_t **row) {
+    if (bit_depth == 1) {
+        for (int x = 0; x < width; x++) {
+            const uint8_t *packed = glyph_packed(cache, unicode[x]);
+            for (int fy = 0; fy < FONT_WIDTH; fy++) {
+                memcpy(row[fy] + x * GLYPH_PACKED_ROW, packed + fy * GLYPH_PACKED_ROW, GLYPH_PACKED_ROW);
+            }
+        }
+    } else {
+        for (int x = 0; x < width; x++) {
+            const uint8_t *tile = glyph_tile(cache, unicode[x]);
+            for (int fy = 0; fy < FONT_WIDTH; fy++) {
+                memcpy(row[fy] + x * FONT_WIDTH, tile + fy * FONT_WIDTH, FONT_WIDTH);
+            }
+        }
+    }
+}
+
+static int find_strike_index(FT_Face face) {
+    for (int i = 0; i < face->num_fixed_sizes; i++) {
+        if (face->available_sizes[i].height == FONT_WIDTH) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int expand_glyph(FT_Face face, uint32_t unicode, uint8_t *tile, uint8_t *packed) {
+    FT_UInt glyph_index = FT_Get_Char_Index(face, unicode);
+    if (glyph_index == 0) {
+        ERR("グリフが見つかりません: U+%X", unicode);
+        return 0;
+    }
+    int error = FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT);
+    if (error) {
+        ERR("グリフの読み出しに失敗しました: U+%X", unicode);
+        return 0;
+    }
+    if (face->glyph->format != FT_GLYPH_FORMAT_BITMAP) {
+        ERR("ビットマップグリフではありません: U+%X", unicode);
+        return 0;
+    }
+    FT_Bitmap *bitmap = &face->glyph->bitmap;
+    if (bitmap->pixel_mode != FT_PIXEL_MODE_MONO ||
+        bitmap->width != FONT_WIDTH) {
+        ERR("全角文字ではありません: U+%X", unicode);
+        return 0;
+    }
+    memset(tile, 1, GLYPH_TILE_SIZE);
+    memset(packed, 0xff, GLYPH_PACKED_SIZE);
+    int extra_bits = bitmap->width % 8;
+    int last_bits = extra_bits == 0 ? 8 : extra_bits;
+    for (int fy = 0; fy < bitmap->rows && fy < FONT_WIDTH; fy++) {
+        for (int p = 0; p < bitmap->pitch; p++) {
+            const int bits = p < bitmap->pitch - 1 ? 8 : last_bits;
+            const int c = bitmap->buffer[bitmap->pitch * fy + p];
+            // MONOビットマップは1が黒なので反転するだけでよい
+            if (p < GLYPH_PACKED_ROW) {
+                packed[fy * GLYPH_PACKED_ROW + p] = ~c;
+            }
+            for (int i = 0; i < bits; i++) {
+                int fx = p * 8 + i;
+                tile[fy * FONT_WIDTH + fx] = (c & (1 << (7 - i))) == 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void unpack_glyph(const uint8_t *packed, uint8_t *tile) {
+    for (int fy = 0; fy < FONT_WIDTH; fy++) {
+        for (int fx = 0; fx < FONT_WIDTH; fx++) {
+            tile[fy * FONT_WIDTH + fx] = (packed[fy * GLYPH_PACKED_ROW + fx / 8] >> (7 - fx % 8)) & 1;
+        }
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef GLYPH_CACHE_H
+#define GLYPH_CACHE_H
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include "common.h"
+#include "binary_book.h"
+
+#define GLYPH_CODE_MAX 0x10000
+// コマンドが使うフォント。カレントディレクトリに置く
+#define DEFAULT_FONT_FILE "msgothic.ttc"
+#define GLYPH_TILE_SIZE (FONT_WIDTH * FONT_WIDTH)
+
+// 文字コードから、FONT_WIDTH x FONT_WIDTH に展開したグリフ (0: 黒, 1: 白) を引く表
+// packed は同じグリフを1画素1ビット (上位ビットが左) に詰めたもの
+// 読み込みは1スレッドで行い、すべて読み込んだ後は複数スレッドから参照できる
+// グリフアトラスから作った場合はフォントを開かず (face は NULL)、packed はマップした領域をそのまま指す
+typedef struct glyph_cache_t {
+    FT_Library library;
+    FT_Face face;
+    int *slot;
+    uint8_t (*tile)[GLYPH_TILE_SIZE];
+    uint8_t (*packed)[GLYPH_PACKED_SIZE];
+    int size;
+    int capacity;
+    int mapped;
+} glyph_cache_t;
+
+// 読み込みに失敗した場合はメッセージを表示して 0 を返す (init_* と load_code_book_glyphs は確保したものを解放済み)
+int init_glyph_cache(glyph_cache_t *cache, const char *font_file);
+int init_atlas_glyph_cache(glyph_cache_t *cache, glyph_atlas_t *atlas);
+int load_code_book_glyphs(glyph_cache_t *cache, code_book_t *code_book, binary_book_t *binary_book, const char *font_file);
+void free_glyph_cache(glyph_cache_t *cache);
+int load_glyph(glyph_cache_t *cache, uint32_t unicode);
+int load_aa_glyphs(glyph_cache_t *cache, aa_t *aa);
+void render_glyph_row(glyph_cache_t *cache, const uint32_t *unicode, int width, int bit_depth, uint8_t **row);
+
+static inline const uint8_t *glyph_tile(glyph_cache_t *cache, uint32_t unicode) {
+    return cache->tile[cache->slot[unicode]];
+}
+
+static inline const uint8_t *glyph_packed(glyph_cache_t *cache, uint32_t unicode) {
+    return cache->packed[cache->slot[unicode]];
+}
+
+#endif //GLYPH_CACHE_H
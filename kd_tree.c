@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <limits.h>
+#include <string.h>
+#include "kd_tree.h"
+
+typedef struct kd_query_t {
+    uint8_t *sample;
+    int offset[CODE_SIZE];
+    int min;
+    int index;
+    long visit;
+    long evaluation;
+    distance_count_t *count;
+} kd_query_t;
+
+typedef struct kd_branch_t {
+    int bound;
+    int node;
+    uint16_t offset[CODE_SIZE];
+} kd_branch_t;
+
+static int add_node(kd_tree_t *kd_tree);
+static int build_node(kd_tree_t *kd_tree, int start, int end);
+static int partition(kd_tree_t *kd_tree, int start, int end, int dim, int split);
+static void swap_entry(kd_tree_t *kd_tree, int a, int b);
+static void init_query(kd_query_t *query, uint8_t *sample, int min, int index, distance_count_t *count);
+static void scan_leaf(kd_tree_t *kd_tree, kd_node_t *node, kd_query_t *query);
+static void search_node(kd_tree_t *kd_tree, int node_index, int bound, kd_query_t *query);
+static void push_branch(kd_branch_t *heap, int *heap_size, int node, int bound, int *offset);
+static kd_branch_t pop_branch(kd_branch_t *heap, int *heap_size);
+
+void init_kd_tree(kd_tree_t *kd_tree, code_book_t *code_book) {
+    int size = code_book->size;
+    kd_tree->size = size;
+    kd_tree->mapped = 0;
+    kd_tree->order = xmalloc(sizeof(int) * size);
+    kd_tree->code = xmalloc(sizeof(uint8_t[CODE_SIZE]) * size);
+    for (int i = 0; i < size; i++) {
+        kd_tree->order[i] = i;
+        memcpy(kd_tree->code[i], code_book->code[i]->code, CODE_SIZE);
+    }
+    kd_tree->node_size = 0;
+    kd_tree->node_capacity = 8;
+    kd_tree->node = xmalloc(sizeof(kd_node_t) * kd_tree->node_capacity);
+    build_node(kd_tree, 0, size);
+}
+
+void map_kd_tree(kd_tree_t *kd_tree, int size, int *order, uint8_t (*code)[CODE_SIZE], kd_node_t *node, int node_size) {
+    kd_tree->size = size;
+    kd_tree->order = order;
+    kd_tree->code = code;
+    kd_tree->node = node;
+    kd_tree->node_size = node_size;
+    kd_tree->node_capacity = node_size;
+    kd_tree->mapped = 1;
+}
+
+void free_kd_tree(kd_tree_t *kd_tree) {
+    if (kd_tree->mapped) {
+        return;
+    }
+    free(kd_tree->order);
+    free(kd_tree->code);
+    free(kd_tree->node);
+}
+
+// min と index に近傍のセルの結果などを与えると、それを初期値として枝刈りする
+// 初期値が無い場合は min に INT_MAX を与える
+int search_kd_tree(kd_tree_t *kd_tree, uint8_t *sample, int min, int index, long *visit, distance_count_t *count) {
+    kd_query_t query;
+    init_query(&query, sample, min, index, count);
+    search_node(kd_tree, 0, 0, &query);
+    if (visit != NULL) {
+        *visit += query.visit;
+    }
+    return query.index;
+}
+
+// 下限の小さい枝から順に探索し (best-bin-first)、max_check 件の距離を計算したところで打ち切る近似検索
+// max_check を十分大きくすると正確な検索と同じ結果になる
+int search_kd_tree_approximate(kd_tree_t *kd_tree, uint8_t *sample, int min, int index, int max_check,
+                               long *visit, distance_count_t *count) {
+    kd_query_t query;
+    init_query(&query, sample, min, index, count);
+    kd_branch_t heap[KD_HEAP_SIZE];
+    int heap_size = 0;
+    push_branch(heap, &heap_size, 0, 0, query.offset);
+    while (heap_size > 0 && query.evaluation < max_check) {
+        kd_branch_t branch = pop_branch(heap, &heap_size);
+        if (branch.bound > query.min) {
+            break;
+        }
+        for (int d = 0; d < CODE_SIZE; d++) {
+            query.offset[d] = branch.offset[d];
+        }
+        kd_node_t *node = &kd_tree->node[branch.node];
+        int bound = branch.bound;
+        while (node->dim >= 0) {
+            query.visit++;
+            int dim = node->dim;
+            int diff = sample[dim] - node->split;
+            int near = diff <= 0 ? node->left : node->right;
+            int far = diff <= 0 ? node->right : node->left;
+            int offset = diff <= 0 ? 1 - diff : diff;
+            int far_bound = bound + offset - query.offset[dim];
+            if (far_bound <= query.min) {
+                int old_offset = query.offset[dim];
+                query.offset[dim] = offset;
+                push_branch(heap, &heap_size, far, far_bound, query.offset);
+                query.offset[dim] = old_offset;
+            }
+            node = &kd_tree->node[near];
+        }
+        query.visit++;
+        scan_leaf(kd_tree, node, &query);
+    }
+    if (visit != NULL) {
+        *visit += query.visit;
+    }
+    return query.index;
+}
+
+static int add_node(kd_tree_t *kd_tree) {
+    if (kd_tree->node_size == kd_tree->node_capacity) {
+        kd_tree->node_capacity *= 2;
+        kd_tree->node = xrealloc(kd_tree->node, sizeof(kd_node_t) * kd_tree->node_capacity);
+    }
+    return kd_tree->node_size++;
+}
+
+static int build_node(kd_tree_t *kd_tree, int start, int end) {
+    int node_index = add_node(kd_tree);
+    kd_node_t *node = &kd_tree->node[node_index];
+    node->dim = -1;
+    node->start = start;
+    node->end = end;
+    if (end - start <= KD_LEAF_SIZE) {
+        return node_index;
+    }
+    int dim = 0;
+    int spread = 0;
+    for (int d = 0; d < CODE_SIZE; d++) {
+        int low = 255;
+        int high = 0;
+        for (int i = start; i < end; i++) {
+            int c = kd_tree->code[i][d];
+            low = c < low ? c : low;
+            high = c > high ? c : high;
+        }
+        if (high - low > spread) {
+            spread = high - low;
+            dim = d;
+        }
+    }
+    if (spread == 0) {
+        return node_index;
+    }
+    int histogram[256];
+    memset(histogram, 0, sizeof(histogram));
+    int high = 0;
+    for (int i = start; i < end; i++) {
+        int c = kd_tree->code[i][dim];
+        histogram[c]++;
+        high = c > high ? c : high;
+    }
+    // 中央値で分割する。最大値で分割すると右が空になるため、その場合は一つ手前で分割する
+    int split = 0;
+    int count = 0;
+    for (split = 0; split < 256; split++) {
+        count += histogram[split];
+        if (count * 2 >= end - start) {
+            break;
+        }
+    }
+    if (split == high) {
+        split--;
+    }
+    int middle = partition(kd_tree, start, end, dim, split);
+    int left = build_node(kd_tree, start, middle);
+    int right = build_node(kd_tree, middle, end);
+    node = &kd_tree->node[node_index];
+    node->dim = dim;
+    node->split = split;
+    node->left = left;
+    node->right = right;
+    return node_index;
+}
+
+static int partition(kd_tree_t *kd_tree, int start, int end, int dim, int split) {
+    int middle = start;
+    for (int i = start; i < end; i++) {
+        if (kd_tree->code[i][dim] <= split) {
+            swap_entry(kd_tree, i, middle++);
+        }
+    }
+    return middle;
+}
+
+static void swap_entry(kd_tree_t *kd_tree, int a, int b) {
+    if (a == b) {
+        return;
+    }
+    uint8_t code[CODE_SIZE];
+    memcpy(code, kd_tree->code[a], CODE_SIZE);
+    memcpy(kd_tree->code[a], kd_tree->code[b], CODE_SIZE);
+    memcpy(kd_tree->code[b], code, CODE_SIZE);
+    int order = kd_tree->order[a];
+    kd_tree->order[a] = kd_tree->order[b];
+    kd_tree->order[b] = order;
+}
+
+static void init_query(kd_query_t *query, uint8_t *sample, int min, int index, distance_count_t *count) {
+    query->sample = sample;
+    memset(query->offset, 0, sizeof(query->offset));
+    query->min = min;
+    query->index = index;
+    query->visit = 0;
+    query->evaluation = 0;
+    query->count = count;
+}
+
+static void scan_leaf(kd_tree_t *kd_tree, kd_node_t *node, kd_query_t *query) {
+    for (int pos = node->start; pos < node->end; pos++) {
+        int d = calculate_distance_bounded(query->sample, kd_tree->code[pos], query->min, query->count);
+        int i = kd_tree->order[pos];
+        if (query->min > d || (query->min == d && query->index > i)) {
+            query->min = d;
+            query->index = i;
+        }
+    }
+    query->evaluation += node->end - node->start;
+}
+
+// bound は query から node の領域までのL1距離の下限
+// 総当たりと同じ結果にするため、同距離の候補がありうる領域 (bound == min) も探索する
+static void search_node(kd_tree_t *kd_tree, int node_index, int bound, kd_query_t *query) {
+    kd_node_t *node = &kd_tree->node[node_index];
+    query->visit++;
+    if (node->dim < 0) {
+        scan_leaf(kd_tree, node, query);
+        return;
+    }
+    int dim = node->dim;
+    int diff = query->sample[dim] - node->split;
+    int near = diff <= 0 ? node->left : node->right;
+    int far = diff <= 0 ? node->right : node->left;
+    int offset = diff <= 0 ? 1 - diff : diff;
+    search_node(kd_tree, near, bound, query);
+    int old_offset = query->offset[dim];
+    bound += offset - old_offset;
+    if (bound <= query->min) {
+        query->offset[dim] = offset;
+        search_node(kd_tree, far, bound, query);
+        query->offset[dim] = old_offset;
+    }
+}
+
+// 下限 bound の最小ヒープ。近似検索なので、あふれた枝は捨てる
+static void push_branch(kd_branch_t *heap, int *heap_size, int node, int bound, int *offset) {
+    if (*heap_size == KD_HEAP_SIZE) {
+        return;
+    }
+    int i = (*heap_size)++;
+    while (i > 0 && heap[(i - 1) / 2].bound > bound) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i].bound = bound;
+    heap[i].node = node;
+    for (int d = 0; d < CODE_SIZE; d++) {
+        heap[i].offset[d] = offset[d];
+    }
+}
+
+static kd_branch_t pop_branch(kd_branch_t *heap, int *heap_size) {
+    kd_branch_t top = heap[0];
+    kd_branch_t last = heap[--(*heap_size)];
+    int i = 0;
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= *heap_size) {
+            break;
+        }
+        if (child + 1 < *heap_size && heap[child + 1].bound < heap[child].bound) {
+            child++;
+        }
+        if (heap[child].bound >= last.bound) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
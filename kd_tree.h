@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef KD_TREE_H
+#define KD_TREE_H
+
+#include "common.h"
+
+#define KD_LEAF_SIZE 8
+#define KD_HEAP_SIZE 1024
+
+typedef struct kd_node_t {
+    int dim;
+    int split;
+    int left;
+    int right;
+    int start;
+    int end;
+} kd_node_t;
+
+// コードブックの9次元ベクトルに対するkd木
+// 葉の要素は木の並び順に複製して持ち、order で元のインデックスへ戻す
+// mapped の場合、各配列はバイナリ形式のコードブックをマップした領域を指し、解放しない
+typedef struct kd_tree_t {
+    int size;
+    int *order;
+    uint8_t (*code)[CODE_SIZE];
+    kd_node_t *node;
+    int node_size;
+    int node_capacity;
+    int mapped;
+} kd_tree_t;
+
+void init_kd_tree(kd_tree_t *kd_tree, code_book_t *code_book);
+void map_kd_tree(kd_tree_t *kd_tree, int size, int *order, uint8_t (*code)[CODE_SIZE], kd_node_t *node, int node_size);
+void free_kd_tree(kd_tree_t *kd_tree);
+int search_kd_tree(kd_tree_t *kd_tree, uint8_t *sample, int min, int index, long *visit, distance_count_t *count);
+int search_kd_tree_approximate(kd_tree_t *kd_tree, uint8_t *sample, int min, int index, int max_check,
+                               long *visit, distance_count_t *count);
+
+#endif //KD_TREE_H
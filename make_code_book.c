@@ -5,47 +5,189 @@
  * http://opensource.org/licenses/MIT
  */
 
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include "common.h"
+#include "binary_book.h"
 
-static int find_strike_index(FT_Face face);
+#define FIRST_CODE 0x80
+#define LAST_CODE 0xffff
+#define CODE_CHUNK 256
+#define REPORT_STEP 10
 
-static code_cell_t *make_code_cell(FT_Face face, FT_ULong unicode);
+// 文字コードの範囲を CODE_CHUNK 件ずつに分け、各スレッドは next を進めながら未処理の範囲を取る
+// 結果は文字コードの位置に格納し、最後に文字コード順に並べるため、スレッド数によらず同じ出力になる
+// glyph にはグリフアトラス用に1ビットに詰めたグリフを格納する
+typedef struct rasterizer_t {
+    int next;
+    int done;
+    int reported;
+    code_cell_t **cell;
+    uint8_t (*glyph)[GLYPH_PACKED_SIZE];
+    struct timespec start;
+} rasterizer_t;
 
-static int compare_code(const void *a, const void *b);
+typedef struct rasterize_work_t {
+    pthread_t thread_id;
+    FT_Library library;
+    FT_Face face;
+    rasterizer_t *rasterizer;
+} rasterize_work_t;
 
-static void print_code_book(FILE *file, code_book_t *code_book);
+static int find_strike_index(FT_Face face);
+static int open_font(rasterize_work_t *work);
+static int rasterize_code_book(code_book_t *code_book, glyph_atlas_t *atlas, int thread_num);
+static void *rasterize_fragment(void *argument);
+static double elapsed_seconds(struct timespec *start);
+static code_cell_t *make_code_cell(FT_Face face, FT_ULong unicode, uint8_t *glyph);
 
 int main(int argc, char **argv) {
-    FT_Face face;
-    FT_Library library;
-    FT_Init_FreeType(&library);
-    if (FT_New_Face(library, "msgothic.ttc", 0, &face) != 0) {
-        ERR("フォントが読み込めません。msgothic.ttc を同じディレクトリに置いてください");
-        return EXIT_FAILURE;
+    char *text_file = NULL;
+    char *binary_file = NULL;
+    int with_kd_tree = 0;
+    int thread_num = default_thread_num();
+    int opt;
+    while ((opt = getopt(argc, argv, "c:b:tj:")) != -1) {
+        switch (opt) {
+            case 'j':
+                thread_num = atoi(optarg);
+                break;
+            case 'c':
+                text_file = optarg;
+                break;
+            case 'b':
+                binary_file = optarg;
+                break;
+            case 't':
+                with_kd_tree = 1;
+                break;
+            default:
+                ERR("使用方法: make_code_book [-j <jobs>] [-c <text code book>] [-b <binary code book> [-t]]");
+                return EXIT_FAILURE;
+        }
     }
-    int strike_index = find_strike_index(face);
-    if (strike_index < 0) {
-        ERR("対象サイズが見つかりません");
-        return EXIT_FAILURE;
+    if (thread_num < 1) {
+        thread_num = default_thread_num();
     }
-    FT_Select_Size(face, strike_index);
     code_book_t code_book;
     init_code_book(&code_book);
-    for (int i = 0x80; i <= 0xffff; i++) {
-        code_cell_t *code = make_code_cell(face, i);
-        if (code != NULL) {
-            add_code_book(&code_book, code);
-        }
+    glyph_atlas_t atlas = {0, NULL, NULL};
+    // テキスト形式のコードブックを指定した場合は、フォントを使わずにそれを変換する (グリフアトラスは作れない)
+    if (text_file != NULL) {
+        read_code_book_file(text_file, &code_book);
+    } else if (!rasterize_code_book(&code_book, &atlas, thread_num)) {
+        return EXIT_FAILURE;
     }
-    FT_Done_Face(face);
-    FT_Done_FreeType(library);
     print_code_book(stdout, &code_book);
+    if (binary_file != NULL) {
+        write_binary_book_file(binary_file, &code_book, with_kd_tree, text_file == NULL ? &atlas : NULL);
+    }
     free_code_book(&code_book);
+    free(atlas.unicode);
+    free(atlas.glyph);
     return EXIT_SUCCESS;
 }
 
+// FreeType のオブジェクトはスレッド間で共有できないため、スレッドごとにフォントを開く
+static int rasterize_code_book(code_book_t *code_book, glyph_atlas_t *atlas, int thread_num) {
+    rasterizer_t rasterizer;
+    rasterizer.next = FIRST_CODE;
+    rasterizer.done = 0;
+    rasterizer.reported = 0;
+    rasterizer.cell = xmalloc(sizeof(code_cell_t *) * (LAST_CODE + 1));
+    memset(rasterizer.cell, 0, sizeof(code_cell_t *) * (LAST_CODE + 1));
+    rasterizer.glyph = xmalloc(sizeof(uint8_t[GLYPH_PACKED_SIZE]) * (LAST_CODE + 1));
+    clock_gettime(CLOCK_MONOTONIC, &rasterizer.start);
+    rasterize_work_t works[thread_num];
+    for (int i = 0; i < thread_num; i++) {
+        works[i].rasterizer = &rasterizer;
+        if (!open_font(&works[i])) {
+            return 0;
+        }
+    }
+    for (int i = 1; i < thread_num; i++) {
+        pthread_create(&works[i].thread_id, NULL, rasterize_fragment, &works[i]);
+    }
+    rasterize_fragment(&works[0]);
+    for (int i = 1; i < thread_num; i++) {
+        pthread_join(works[i].thread_id, NULL);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        FT_Done_Face(works[i].face);
+        FT_Done_FreeType(works[i].library);
+    }
+    for (int i = FIRST_CODE; i <= LAST_CODE; i++) {
+        if (rasterizer.cell[i] != NULL) {
+            add_code_book(code_book, rasterizer.cell[i]);
+        }
+    }
+    atlas->size = code_book->size;
+    atlas->unicode = xmalloc(sizeof(uint32_t) * atlas->size);
+    atlas->glyph = xmalloc(sizeof(uint8_t[GLYPH_PACKED_SIZE]) * atlas->size);
+    for (int i = 0; i < atlas->size; i++) {
+        uint32_t unicode = code_book->code[i]->unicode;
+        atlas->unicode[i] = unicode;
+        memcpy(atlas->glyph[i], rasterizer.glyph[unicode], GLYPH_PACKED_SIZE);
+    }
+    free(rasterizer.cell);
+    free(rasterizer.glyph);
+    PRT("%d 文字, %d スレッド, %.2f 秒\n", code_book->size, thread_num, elapsed_seconds(&rasterizer.start));
+    return 1;
+}
+
+static int open_font(rasterize_work_t *work) {
+    FT_Init_FreeType(&work->library);
+    if (FT_New_Face(work->library, "msgothic.ttc", 0, &work->face) != 0) {
+        ERR("フォントが読み込めません。msgothic.ttc を同じディレクトリに置いてください");
+        return 0;
+    }
+    int strike_index = find_strike_index(work->face);
+    if (strike_index < 0) {
+        ERR("対象サイズが見つかりません");
+        return 0;
+    }
+    FT_Select_Size(work->face, strike_index);
+    return 1;
+}
+
+static void *rasterize_fragment(void *argument) {
+    rasterize_work_t *work = (rasterize_work_t *) argument;
+    rasterizer_t *rasterizer = work->rasterizer;
+    int total = LAST_CODE - FIRST_CODE + 1;
+    for (;;) {
+        int start = __atomic_fetch_add(&rasterizer->next, CODE_CHUNK, __ATOMIC_RELAXED);
+        if (start > LAST_CODE) {
+            break;
+        }
+        int end = start + CODE_CHUNK - 1 < LAST_CODE ? start + CODE_CHUNK - 1 : LAST_CODE;
+        for (int i = start; i <= end; i++) {
+            rasterizer->cell[i] = make_code_cell(work->face, i, rasterizer->glyph[i]);
+        }
+        // 進捗は REPORT_STEP % ごとに、その区切りを最初に越えたスレッドが表示する
+        int done = __atomic_add_fetch(&rasterizer->done, end - start + 1, __ATOMIC_RELAXED);
+        int step = done * REPORT_STEP / total;
+        int reported = __atomic_load_n(&rasterizer->reported, __ATOMIC_RELAXED);
+        while (step > reported) {
+            if (__atomic_compare_exchange_n(&rasterizer->reported, &reported, step, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                PRT("%3d%% %.2f 秒\n", step * 100 / REPORT_STEP, elapsed_seconds(&rasterizer->start));
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static double elapsed_seconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
 static int find_strike_index(FT_Face face) {
     for (int i = 0; i < face->num_fixed_sizes; i++) {
         if (face->available_sizes[i].height == FONT_WIDTH) {
@@ -55,7 +197,8 @@ static int find_strike_index(FT_Face face) {
     return -1;
 }
 
-static code_cell_t *make_code_cell(FT_Face face, FT_ULong unicode) {
+// glyph には1ビットに詰めたグリフ (0: 黒, 1: 白) を書き込む
+static code_cell_t *make_code_cell(FT_Face face, FT_ULong unicode, uint8_t *glyph) {
     FT_UInt glyph_index = FT_Get_Char_Index(face, unicode);
     if (glyph_index == 0) {
         return NULL;
@@ -74,6 +217,13 @@ static code_cell_t *make_code_cell(FT_Face face, FT_ULong unicode) {
     }
     int code[CODE_SIZE];
     memset(code, 0, sizeof(code));
+    // MONOビットマップは1が黒なので反転するだけでよい
+    memset(glyph, 0xff, GLYPH_PACKED_SIZE);
+    for (int y = 0; y < bitmap->rows && y < FONT_WIDTH; y++) {
+        for (int p = 0; p < bitmap->pitch && p < GLYPH_PACKED_ROW; p++) {
+            glyph[y * GLYPH_PACKED_ROW + p] = ~bitmap->buffer[bitmap->pitch * y + p];
+        }
+    }
     int extra_bits = bitmap->width % 8;
     int last_bits = extra_bits == 0 ? 8 : extra_bits;
     for (int y = 0; y < bitmap->rows; y++) {
@@ -100,42 +250,3 @@ static code_cell_t *make_code_cell(FT_Face face, FT_ULong unicode) {
     }
     return result;
 }
-
-static int compare_code(const void *a, const void *b) {
-    code_cell_t *ac = *(code_cell_t **) a;
-    code_cell_t *bc = *(code_cell_t **) b;
-    int total = 0;
-    for (int i = 0; i < CODE_SIZE; i++) {
-        total += ac->code[i] - bc->code[i];
-    }
-    if (total != 0) {
-        return total;
-    }
-    for (int i = 0; i < CODE_SIZE; i++) {
-        int diff = ac->code[i] - bc->code[i];
-        if (diff != 0) {
-            return diff;
-        }
-    }
-    return 0;
-}
-
-static void print_code_book(FILE *file, code_book_t *code_book) {
-    qsort(code_book->code, code_book->size, sizeof(code_cell_t *), compare_code);
-    code_cell_t *last_cell = NULL;
-    for (int i = 0; i < code_book->size; i++) {
-        code_cell_t *code_cell = code_book->code[i];
-        if (last_cell == NULL || compare_code(&last_cell, &code_cell) != 0) {
-            if (last_cell != NULL) {
-                fprintf(file, "\n");
-            }
-            for (int j = 0; j < CODE_SIZE; j++) {
-                fprintf(file, "%02x,", code_cell->code[j]);
-            }
-        }
-        last_cell = code_cell;
-        print_unicode_as_utf8(file, code_cell->unicode);
-        // fprintf(file, " %04x ", code_cell->unicode);
-    }
-    fprintf(file, "\n");
-}
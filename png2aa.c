@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "common.h"
+#include "png_image.h"
+#include "search.h"
+#include "glyph_cache.h"
+#include "png2aa.h"
+
+#if CODE_WIDTH != PNG2AA_CELL_WIDTH || FONT_WIDTH != PNG2AA_GLYPH_WIDTH
+#error "png2aa.h の定数が common.h と一致しません"
+#endif
+
+// match_mutex: 検索スレッド群は1枚ずつしか処理できないため、png2aa_match の呼び出しを順に並べる
+// glyph_mutex: グリフは初回の png2aa_render で1スレッドだけが読み込む。glyph_state は 0: 未読み込み, 1: 読み込み済み, -1: 失敗
+struct png2aa_t {
+    code_book_t book;
+    binary_book_t binary_book;
+    int binary;
+    uint8_t luminance[256];
+    search_t search;
+    search_pool_t pool;
+    pthread_mutex_t match_mutex;
+    pthread_mutex_t glyph_mutex;
+    int glyph_state;
+    char *font_file;
+    glyph_cache_t cache;
+};
+
+void png2aa_default_option(png2aa_option_t *option) {
+    option->search = "brute";
+    option->metric = "l1";
+    option->cache_size = DEFAULT_CACHE_SIZE;
+    option->seed = 0;
+    option->max_check = DEFAULT_MAX_CHECK;
+    option->thread_num = 0;
+    option->font_file = NULL;
+}
+
+png2aa_t *png2aa_open(const char *code_book_file, const png2aa_option_t *option) {
+    png2aa_option_t defaults;
+    if (option == NULL) {
+        png2aa_default_option(&defaults);
+        option = &defaults;
+    }
+    search_option_t search_option;
+    search_option.mode = SEARCH_BRUTE;
+    search_option.metric = METRIC_L1;
+    if (code_book_file == NULL ||
+        (option->search != NULL && !parse_search_mode(option->search, &search_option.mode)) ||
+        (option->metric != NULL && !parse_metric(option->metric, &search_option.metric))) {
+        return NULL;
+    }
+    if (search_option.metric != METRIC_L1 && search_option.mode != SEARCH_BATCH) {
+        return NULL;
+    }
+    search_option.cache_size = option->cache_size > 0 ? option->cache_size : DEFAULT_CACHE_SIZE;
+    search_option.seed = option->seed != 0;
+    search_option.max_check = option->max_check > 0 ? option->max_check : DEFAULT_MAX_CHECK;
+    search_option.evaluate = 0;
+    int thread_num = option->thread_num;
+    if (thread_num < 1) {
+        thread_num = default_thread_num();
+    }
+    png2aa_t *context = xmalloc(sizeof(png2aa_t));
+    // load_code_book_file などは const でない引数を取るが、書き換えはしない
+    // コマンドと違い、読み出せない場合も終了せずに NULL を返す
+    char *filename = (char *) code_book_file;
+    if (!check_binary_book_file(filename, &context->binary)) {
+        free(context);
+        return NULL;
+    }
+    if (context->binary) {
+        if (!load_binary_book_file(filename, &context->binary_book)) {
+            free(context);
+            return NULL;
+        }
+        binary_book_to_code_book(&context->binary_book, &context->book);
+    } else {
+        init_code_book(&context->book);
+        int loaded = load_code_book_file(filename, &context->book);
+        if (loaded && context->book.size == 0) {
+            ERR("コードブックが空です: %s", filename);
+        }
+        if (!loaded || context->book.size == 0) {
+            free_code_book(&context->book);
+            free(context);
+            return NULL;
+        }
+    }
+    init_luminance(&context->book, context->luminance);
+    // 距離計算カーネルの選択は、検索スレッド群が最初の検索で同時に行わないよう先に済ませる
+    init_distance_kernel();
+    init_search(&context->search, &search_option, &context->book, context->binary ? &context->binary_book : NULL);
+    init_search_pool(&context->pool, &context->search, thread_num);
+    pthread_mutex_init(&context->match_mutex, NULL);
+    pthread_mutex_init(&context->glyph_mutex, NULL);
+    context->glyph_state = 0;
+    context->font_file = option->font_file != NULL ? strdup(option->font_file) : NULL;
+    return context;
+}
+
+void png2aa_close(png2aa_t *context) {
+    if (context == NULL) {
+        return;
+    }
+    free_search_pool(&context->pool, NULL);
+    free_search(&context->search);
+    if (context->glyph_state > 0) {
+        free_glyph_cache(&context->cache);
+    }
+    free(context->font_file);
+    free_code_book(&context->book);
+    if (context->binary) {
+        unmap_binary_book(&context->binary_book);
+    }
+    pthread_mutex_destroy(&context->match_mutex);
+    pthread_mutex_destroy(&context->glyph_mutex);
+    free(context);
+}
+
+int png2aa_match(png2aa_t *context, const uint8_t *gray, int width, int height, int stride, uint32_t *aa) {
+    if (context == NULL || gray == NULL || aa == NULL ||
+        width < CODE_WIDTH || height < CODE_WIDTH || stride < width) {
+        return 0;
+    }
+    image_t image;
+    init_image(&image, width, height, IMAGE_ROW_MAJOR);
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = gray + (size_t) stride * y;
+        for (int x = 0; x < width; x++) {
+            image.map[y][x] = context->luminance[row[x]];
+        }
+    }
+    aa_t result;
+    init_aa(&result, width / CODE_WIDTH, height / CODE_WIDTH);
+    pthread_mutex_lock(&context->match_mutex);
+    run_search_pool(&context->pool, &image, &result);
+    pthread_mutex_unlock(&context->match_mutex);
+    for (int y = 0; y < result.height; y++) {
+        memcpy(aa + (size_t) result.width * y, result.map[y], sizeof(uint32_t) * result.width);
+    }
+    free_aa(&result);
+    free_image(&image);
+    return 1;
+}
+
+int png2aa_render(png2aa_t *context, const uint32_t *aa, int aa_width, int aa_height, uint8_t *bitmap, int stride) {
+    if (context == NULL || aa == NULL || bitmap == NULL ||
+        aa_width < 1 || aa_height < 1 || stride < aa_width * FONT_WIDTH) {
+        return 0;
+    }
+    pthread_mutex_lock(&context->glyph_mutex);
+    if (context->glyph_state == 0) {
+        int loaded = load_code_book_glyphs(&context->cache, &context->book,
+                                           context->binary ? &context->binary_book : NULL, context->font_file);
+        context->glyph_state = loaded ? 1 : -1;
+    }
+    int glyph_state = context->glyph_state;
+    pthread_mutex_unlock(&context->glyph_mutex);
+    if (glyph_state < 0) {
+        return 0;
+    }
+    size_t cells = (size_t) aa_width * aa_height;
+    for (size_t i = 0; i < cells; i++) {
+        if (aa[i] >= GLYPH_CODE_MAX || context->cache.slot[aa[i]] < 0) {
+            return 0;
+        }
+    }
+    for (int y = 0; y < aa_height; y++) {
+        uint8_t *row[FONT_WIDTH];
+        for (int fy = 0; fy < FONT_WIDTH; fy++) {
+            row[fy] = bitmap + (size_t) stride * (y * FONT_WIDTH + fy);
+        }
+        render_glyph_row(&context->cache, aa + (size_t) aa_width * y, aa_width, 8, row);
+        for (int fy = 0; fy < FONT_WIDTH; fy++) {
+            for (int x = 0; x < aa_width * FONT_WIDTH; x++) {
+                row[fy][x] *= 255;
+            }
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef PNG2AA_H
+#define PNG2AA_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 共有ライブラリは png2aa_ で始まる関数だけを公開する (それ以外はビルド時に非公開にしている)
+#if defined(__GNUC__)
+#define PNG2AA_API __attribute__((visibility("default")))
+#else
+#define PNG2AA_API
+#endif
+
+// 1文字が受け持つ入力画像の画素数 (縦横とも)
+#define PNG2AA_CELL_WIDTH 3
+// 1文字を描画したときの画素数 (縦横とも)
+#define PNG2AA_GLYPH_WIDTH 16
+
+// コードブック、検索の索引、検索スレッドを保持する。中身は公開しない
+typedef struct png2aa_t png2aa_t;
+
+// search: "brute", "sum", "kdtree", "batch", "ann" のいずれか、metric: "l1" または "l2" (batch のみ)
+// 数値は0以下なら既定値を使う。thread_num の既定値はオンラインのCPU数
+// font_file: png2aa_render でグリフを読み込むフォントのパス。NULL (既定値) の場合はグリフアトラスを含むバイナリ形式のコードブックが必要
+typedef struct png2aa_option_t {
+    const char *search;
+    const char *metric;
+    int cache_size;
+    int seed;
+    int max_check;
+    int thread_num;
+    const char *font_file;
+} png2aa_option_t;
+
+PNG2AA_API void png2aa_default_option(png2aa_option_t *option);
+
+// テキストまたはバイナリ形式のコードブックを読み込む。オプションが不正な場合や、
+// コードブックが読み出せない、壊れている、空である場合はメッセージを表示して NULL を返す
+PNG2AA_API png2aa_t *png2aa_open(const char *code_book_file, const png2aa_option_t *option);
+PNG2AA_API void png2aa_close(png2aa_t *context);
+
+// gray は width x height の8ビットグレースケール (1行 stride バイト)。コマンドと同じ輝度調整を行ってから検索する
+// aa には (width / PNG2AA_CELL_WIDTH) x (height / PNG2AA_CELL_WIDTH) 個の文字コードを行の順に書き込む
+// 同じ context に対して同時に呼び出した場合は順に処理する。成功すれば 1 を返す
+PNG2AA_API int png2aa_match(png2aa_t *context, const uint8_t *gray, int width, int height, int stride, uint32_t *aa);
+
+// aa (aa_width x aa_height 個の文字コード) のグリフを並べ、1画素1バイト (0: 黒, 255: 白) で bitmap に描画する
+// bitmap は (aa_width * PNG2AA_GLYPH_WIDTH) x (aa_height * PNG2AA_GLYPH_WIDTH) 画素で、1行 stride バイト
+// グリフは初回に読み込む。グリフを読み込めない場合 (フォントもグリフアトラスも無い場合など) や、コードブックに無い文字を含む場合は 0 を返す
+PNG2AA_API int png2aa_render(png2aa_t *context, const uint32_t *aa, int aa_width, int aa_height, uint8_t *bitmap, int stride);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //PNG2AA_H
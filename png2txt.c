@@ -6,39 +6,169 @@
  */
 
 #include <unistd.h>
-#include <libpng16/png.h>
-#include <setjmp.h>
 #include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 #include "common.h"
+#include "png_image.h"
+#include "search.h"
+#include "aa_file.h"
+#include "glyph_cache.h"
+#include "png_writer.h"
+#include "aa_server.h"
 
-#define DEFAULT_THREAD_NUM 4
+#define STREAM_BAND_PER_THREAD 2
+#define LOAD_SLOT_NUM 2
+#define LOAD_EMPTY 0
+#define LOAD_READY 1
+#define SERVER_QUEUE_SIZE 64
+#define SERVER_TIMEOUT_SEC 10
 
-typedef struct work_t {
+// ストリーミング時の帯。読み出した行 (row) を検索スレッドが輝度に変換 (image) してから検索する
+typedef struct band_t {
+    png_bytep row[CODE_WIDTH];
+    image_t image;
+    aa_t aa;
+    int done;
+} band_t;
+
+// 検索の終わったAAの行を上から順に受け取る。stream_t の mutex を保持した状態で呼ばれる
+typedef void (*emit_row_t)(void *context, int y, uint32_t *row);
+
+// decoded: 読み出し済みの行数、claimed: 検索を始めた行数、written: 出力済みの行数 (単位はAAの行)
+typedef struct stream_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t decoded_cond;
+    pthread_cond_t written_cond;
+    emit_row_t emit;
+    void *context;
+    png_reader_t *reader;
+    band_t *band;
+    int band_num;
+    int height;
+    int decoded;
+    int claimed;
+    int written;
+} stream_t;
+
+// PNGを直接出力する場合、検索の終わった行を aa に集め、PNGの書き出し側は matched 行目まで描画できる
+// 描画し直しのために書き出し済みの行も参照されるため、aa は画像全体分を持つ
+typedef struct fused_t {
     pthread_t thread_id;
-    int start;
-    int end;
+    pthread_mutex_t mutex;
+    pthread_cond_t matched_cond;
+    aa_t aa;
+    int matched;
+    glyph_cache_t *cache;
+    int bit_depth;
+    search_t *search;
+    png_reader_t *reader;
+    image_layout_t layout;
+    int thread_num;
+    search_stat_t *stat;
+} fused_t;
+
+// 画像を検索と並行して先読みするスレッド。slot は LOAD_SLOT_NUM 枚のリングで、state は LOAD_* のいずれか
+typedef struct loader_t {
+    pthread_t thread_id;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char **files;
+    int count;
+    image_layout_t layout;
+    uint8_t *luminance;
+    image_t image[LOAD_SLOT_NUM];
+    int state[LOAD_SLOT_NUM];
+} loader_t;
+
+// 常駐サーバの要求の待ち行列。受け付けた接続を queue のリングに積み、作業スレッドが一つずつ取り出して処理する
+// 待ち行列が一杯の間は新しい接続を受け付けない
+// グリフは最初のPNG出力の要求で1スレッドだけが読み込む。glyph_state は 0: 未読み込み, 1: 読み込み済み, -1: 失敗
+typedef struct server_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t queued_cond;
+    pthread_cond_t freed_cond;
+    int *queue;
+    int queue_size;
+    int head;
+    int count;
     code_book_t *code_book;
+    binary_book_t *binary_book;
+    pthread_mutex_t glyph_mutex;
+    int glyph_state;
+    glyph_cache_t cache;
+    png_option_t *png_option;
+    image_layout_t layout;
+    uint8_t *luminance;
+    int verbose;
+} server_t;
+
+typedef struct work_t {
+    pthread_t thread_id;
+    schedule_t *schedule;
+    stream_t *stream;
+    server_t *server;
     image_t *image;
     aa_t *aa;
+    uint8_t *buffer;
+    matcher_t matcher;
 } work_t;
 
-static void read_code_book_file(char *filename, code_book_t *code_book);
-static void read_code_book_stream(FILE *file, code_book_t *code_book);
-static uint8_t rgb_to_gray(uint8_t r, uint8_t g, uint8_t b);
-static void read_png_file(char *filename, image_t *image);
-static void read_png_stream(FILE *file, image_t *image);
-static void free_image(image_t *img);
-static void image_to_text(FILE *file, code_book_t *code_book, image_t *image, int thread_num);
-static int calculate_distance(uint8_t *a, uint8_t *b);
+static void image_to_text(FILE *file, aa_format_t format, search_t *search, image_t *image, int thread_num, search_stat_t *stat);
+static void stream_to_text(FILE *file, aa_format_t format, search_t *search, png_reader_t *reader, image_layout_t layout, int thread_num, search_stat_t *stat);
+static void stream_to_aa(search_t *search, png_reader_t *reader, image_layout_t layout, int thread_num, search_stat_t *stat, emit_row_t emit, void *context);
+static void emit_text_row(void *context, int y, uint32_t *row);
+static void stream_to_png(FILE *file, png_option_t *png_option, search_t *search, png_reader_t *reader, image_layout_t layout, glyph_cache_t *cache, int thread_num, search_stat_t *stat);
+static void *match_fused(void *argument);
+static int read_image_list(const char *path, char ***files);
+static int compare_file_name(const void *a, const void *b);
+static char *output_file_name(const char *input, const char *output_dir, aa_format_t format);
+static void list_to_text(char **files, int count, const char *output_dir, aa_format_t format, search_t *search, image_layout_t layout, uint8_t *luminance, int thread_num, search_stat_t *stat);
+static void *load_fragment(void *argument);
+static void print_aa(FILE *file, aa_format_t format, aa_t *aa);
+static void serve(const char *path, int queue_size, search_t *search, binary_book_t *binary_book, png_option_t *png_option, image_layout_t layout, uint8_t *luminance, int thread_num, int verbose);
+static void *server_fragment(void *argument);
+static int load_server_glyphs(server_t *server);
+static void handle_request(work_t *work, int fd);
+static void render_server_row(void *context, int y, uint8_t **row);
+static void send_response(int fd, uint32_t status, const void *data, size_t size);
+static void emit_fused_row(void *context, int y, uint32_t *row);
+static void render_fused_row(void *context, int y, uint8_t **row);
+static void init_work(work_t *work, search_t *search);
+static void free_work(work_t *work);
 static void *work_fragment(void *argument);
-static void adjust_luminance(code_book_t *code_book, image_t *image);
+static void *stream_fragment(void *argument);
 
 int main(int argc, char **argv) {
     char *code_book_file = NULL;
     char *image_file = NULL;
-    int thread_num = DEFAULT_THREAD_NUM;
+    int thread_num = default_thread_num();
+    search_option_t option;
+    option.mode = SEARCH_BRUTE;
+    option.metric = METRIC_L1;
+    option.cache_size = DEFAULT_CACHE_SIZE;
+    option.seed = 0;
+    option.max_check = DEFAULT_MAX_CHECK;
+    option.evaluate = 0;
+    char *kernel = NULL;
+    int verbose = 0;
+    int streaming = 0;
+    image_layout_t layout = IMAGE_ROW_MAJOR;
+    aa_format_t format = AA_FORMAT_TEXT;
+    int format_given = 0;
+    char *output_file = NULL;
+    char *list_file = NULL;
+    char *output_dir = NULL;
+    char *server_path = NULL;
+    int queue_size = SERVER_QUEUE_SIZE;
+    png_option_t png_option = {1, -1, -1, -1};
     int opt;
-    while ((opt = getopt(argc, argv, "c:i:j:")) != -1) {
+    while ((opt = getopt(argc, argv, "c:i:j:m:d:k:C:sa:evSBf:o:b:z:F:Z:l:O:D:Q:")) != -1) {
         switch (opt) {
             case 'c':
                 code_book_file = optarg;
@@ -49,271 +179,752 @@ int main(int argc, char **argv) {
             case 'j':
                 thread_num = atoi(optarg);
                 break;
+            case 'm':
+                if (!parse_search_mode(optarg, &option.mode)) {
+                    ERR("不明な検索モードです: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                if (!parse_metric(optarg, &option.metric)) {
+                    ERR("不明な距離です: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'k':
+                kernel = optarg;
+                break;
+            case 'C':
+                option.cache_size = atoi(optarg);
+                break;
+            case 's':
+                option.seed = 1;
+                break;
+            case 'a':
+                option.max_check = atoi(optarg);
+                break;
+            case 'e':
+                option.evaluate = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'S':
+                streaming = 1;
+                break;
+            case 'B':
+                layout = IMAGE_BLOCK_MAJOR;
+                break;
+            case 'f':
+                if (!parse_aa_format(optarg, &format)) {
+                    ERR("不明な出力形式です: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                format_given = 1;
+                break;
+            case 'o':
+                output_file = optarg;
+                break;
+            case 'b':
+                png_option.bit_depth = atoi(optarg);
+                break;
+            case 'z':
+                png_option.level = atoi(optarg);
+                break;
+            case 'F':
+                if (!parse_row_filter(optarg, &png_option.filter)) {
+                    ERR("不明なフィルタです: %s (none, sub, up, avg, paeth, all)", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'Z':
+                if (!parse_png_strategy(optarg, &png_option.strategy)) {
+                    ERR("不明な圧縮戦略です: %s (default, filtered, huffman, rle, fixed)", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                list_file = optarg;
+                break;
+            case 'O':
+                output_dir = optarg;
+                break;
+            case 'D':
+                server_path = optarg;
+                break;
+            case 'Q':
+                queue_size = atoi(optarg);
+                break;
         }
     }
     if (thread_num < 1) {
-        thread_num = DEFAULT_THREAD_NUM;
+        thread_num = default_thread_num();
+    }
+    if (queue_size < 1) {
+        queue_size = SERVER_QUEUE_SIZE;
+    }
+    if (code_book_file == NULL || (image_file != NULL) + (list_file != NULL) + (server_path != NULL) != 1) {
+        ERR("使用用法: png2txt -c <code book> {-i <image> | -l <image list or directory> [-O <output directory>] | -D <socket> [-Q <queue size>]} -j <jobs> -m <brute|sum|kdtree|batch|ann> [-d <l1|l2>] [-k <kernel>] [-C <cache size>] [-s] [-a <checks>] [-e] [-v] [-S] [-B] [-f <text|bin|rle> | -o <output png> [-b <1|8>] [-z <0-9>] [-F <filter>] [-Z <strategy>]]");
+        return EXIT_FAILURE;
+    }
+    if (option.max_check < 1) {
+        option.max_check = DEFAULT_MAX_CHECK;
+    }
+    if ((list_file != NULL || server_path != NULL) && output_file != NULL) {
+        ERR("-l, -D と -o は同時に指定できません");
+        return EXIT_FAILURE;
+    }
+    if (format_given && output_file != NULL) {
+        ERR("-f と -o は同時に指定できません");
+        return EXIT_FAILURE;
+    }
+    if (png_option.bit_depth != 1 && png_option.bit_depth != 8) {
+        ERR("ビット深度は 1 または 8 を指定してください");
+        return EXIT_FAILURE;
+    }
+    if (png_option.level > 9) {
+        ERR("圧縮レベルは 0 から 9 を指定してください");
+        return EXIT_FAILURE;
+    }
+    if (option.metric != METRIC_L1 && option.mode != SEARCH_BATCH) {
+        ERR("L2距離は batch モードでのみ利用できます");
+        return EXIT_FAILURE;
     }
-    if (code_book_file == NULL || image_file == NULL) {
-        ERR("使用用法: png2txt -c <code book> -i <image> -j <jobs>");
+    if (!select_distance_kernel(kernel)) {
+        ERR("この環境では利用できない距離計算カーネルです: %s", kernel);
         return EXIT_FAILURE;
     }
     code_book_t book;
-    init_code_book(&book);
-    read_code_book_file(code_book_file, &book);
-    image_t image;
-    read_png_file(image_file, &image);
-    adjust_luminance(&book, &image);
-    image_to_text(stdout, &book, &image, thread_num);
-    free_image(&image);
+    binary_book_t binary_book;
+    int binary = is_binary_book_file(code_book_file);
+    if (binary) {
+        map_binary_book_file(code_book_file, &binary_book);
+        binary_book_to_code_book(&binary_book, &book);
+    } else {
+        init_code_book(&book);
+        read_code_book_file(code_book_file, &book);
+        if (book.size == 0) {
+            ERR("コードブックが空です: %s", code_book_file);
+            return EXIT_FAILURE;
+        }
+    }
+    uint8_t luminance[256];
+    init_luminance(&book, luminance);
+    search_t search;
+    init_search(&search, &option, &book, binary ? &binary_book : NULL);
+    search_stat_t stat;
+    if (server_path != NULL) {
+        // コードブックと検索の索引を読み込んだまま要求を待ち続ける
+        serve(server_path, queue_size, &search, binary ? &binary_book : NULL, &png_option, layout, luminance, thread_num, verbose);
+    }
+    if (list_file != NULL) {
+        char **files;
+        int count = read_image_list(list_file, &files);
+        list_to_text(files, count, output_dir, format, &search, layout, luminance, thread_num, &stat);
+        for (int i = 0; i < count; i++) {
+            free(files[i]);
+        }
+        free(files);
+    } else if (output_file != NULL) {
+        // AAをテキストにせず、検索した行からそのままグリフを並べてPNGに書き出す
+        glyph_cache_t cache;
+        if (!load_code_book_glyphs(&cache, &book, binary ? &binary_book : NULL, DEFAULT_FONT_FILE)) {
+            return EXIT_FAILURE;
+        }
+        FILE *file = open_png_file(image_file);
+        png_reader_t reader;
+        open_png_reader(file, &reader, luminance);
+        FILE *output = fopen(output_file, "wb");
+        if (output == NULL) {
+            perror(output_file);
+            return EXIT_FAILURE;
+        }
+        stream_to_png(output, &png_option, &search, &reader, layout, &cache, thread_num, &stat);
+        fclose(output);
+        close_png_reader(&reader);
+        if (file != stdin) {
+            fclose(file);
+        }
+        free_glyph_cache(&cache);
+    } else if (streaming) {
+        FILE *file = open_png_file(image_file);
+        png_reader_t reader;
+        open_png_reader(file, &reader, luminance);
+        stream_to_text(stdout, format, &search, &reader, layout, thread_num, &stat);
+        close_png_reader(&reader);
+        if (file != stdin) {
+            fclose(file);
+        }
+    } else {
+        image_t image;
+        read_png_file(image_file, &image, layout, luminance, thread_num);
+        image_to_text(stdout, format, &search, &image, thread_num, &stat);
+        free_image(&image);
+    }
+    if (verbose) {
+        print_search_stat(&search, &stat);
+    }
+    free_search(&search);
     free_code_book(&book);
+    if (binary) {
+        unmap_binary_book(&binary_book);
+    }
     return EXIT_SUCCESS;
 }
 
-static void read_code_book_file(char *filename, code_book_t *code_book) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror(filename);
+static void image_to_text(FILE *file, aa_format_t format, search_t *search, image_t *image, int thread_num, search_stat_t *stat) {
+    int width = image->width / CODE_WIDTH;
+    int height = image->height / CODE_WIDTH;
+    aa_t aa;
+    init_aa(&aa, width, height);
+    schedule_t schedule;
+    init_schedule(&schedule, width, height);
+    work_t *works = xmalloc(sizeof(work_t)* thread_num);
+    if (thread_num > schedule.count) {
+        thread_num = schedule.count;
+    }
+    for (int i = 0; i < thread_num; i++) {
+        init_work(&works[i], search);
+        works[i].schedule = &schedule;
+        works[i].image = image;
+        works[i].aa = &aa;
+        pthread_create(&works[i].thread_id, NULL, work_fragment, &works[i]);
+    }
+    memset(stat, 0, sizeof(search_stat_t));
+    for (int i = 0; i < thread_num; i++) {
+        pthread_join(works[i].thread_id, NULL);
+        add_search_stat(stat, &works[i].matcher.stat);
+        free_work(&works[i]);
+    }
+    free(works);
+    print_aa(file, format, &aa);
+    free_aa(&aa);
+}
+
+static void print_aa(FILE *file, aa_format_t format, aa_t *aa) {
+    aa_writer_t writer;
+    init_aa_writer(&writer, file, format, aa->width, aa->height);
+    for (int y = 0; y < aa->height; y++) {
+        write_aa_row(&writer, aa->map[y]);
+    }
+    free_aa_writer(&writer);
+}
+
+// 一覧ファイル (1行に1つの画像のパス) か、ディレクトリ (名前順の *.png) から画像の一覧を作る
+static int read_image_list(const char *path, char ***files) {
+    int count = 0;
+    int capacity = 256;
+    *files = xmalloc(sizeof(char *) * capacity);
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror(path);
         exit(EXIT_FAILURE);
     }
-    read_code_book_stream(file, code_book);
-    fclose(file);
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t length = strlen(entry->d_name);
+            if (length < 4 || strcasecmp(entry->d_name + length - 4, ".png") != 0) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                *files = xrealloc(*files, sizeof(char *) * capacity);
+            }
+            char *file = xmalloc(strlen(path) + length + 2);
+            sprintf(file, "%s/%s", path, entry->d_name);
+            (*files)[count++] = file;
+        }
+        closedir(dir);
+        qsort(*files, count, sizeof(char *), compare_file_name);
+        return count;
+    }
+    FILE *list = fopen(path, "r");
+    if (list == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_size, list)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = 0;
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            *files = xrealloc(*files, sizeof(char *) * capacity);
+        }
+        (*files)[count++] = strdup(line);
+    }
+    free(line);
+    fclose(list);
+    return count;
+}
+
+static int compare_file_name(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
 }
 
-static void read_code_book_stream(FILE *file, code_book_t *code_book) {
-    char string[100];
-    int code[CODE_SIZE];
-    while (fscanf(file, "%x,%x,%x,%x,%x,%x,%x,%x,%x,%s",
-                  &code[0], &code[1], &code[2],
-                  &code[3], &code[4], &code[5],
-                  &code[6], &code[7], &code[8],
-                  string
-    ) == 10) {
-        code_cell_t *cell = xmalloc(sizeof(code_cell_t));
-        for (int i = 0; i < CODE_SIZE; i++) {
-            cell->code[i] = code[i];
+// 入力の拡張子を出力形式に合わせて置き換える。output_dir があればそのディレクトリに置く
+static char *output_file_name(const char *input, const char *output_dir, aa_format_t format) {
+    const char *base = input;
+    if (output_dir != NULL) {
+        const char *slash = strrchr(input, '/');
+        base = slash != NULL ? slash + 1 : input;
+    }
+    const char *dot = strrchr(base, '.');
+    const char *slash = strrchr(base, '/');
+    size_t length = dot != NULL && (slash == NULL || dot > slash) ? (size_t) (dot - base) : strlen(base);
+    const char *extension = format == AA_FORMAT_TEXT ? ".txt" : ".aa";
+    char *name = xmalloc((output_dir != NULL ? strlen(output_dir) + 1 : 0) + length + strlen(extension) + 1);
+    if (output_dir != NULL) {
+        sprintf(name, "%s/%.*s%s", output_dir, (int) length, base, extension);
+    } else {
+        sprintf(name, "%.*s%s", (int) length, base, extension);
+    }
+    return name;
+}
+
+// コードブックと検索スレッドを使い回して複数の画像を順に変換する
+// 画像 N を検索している間に、読み込み用のスレッドが画像 N+1 を読み込んでおく
+static void list_to_text(char **files, int count, const char *output_dir, aa_format_t format, search_t *search, image_layout_t layout, uint8_t *luminance, int thread_num, search_stat_t *stat) {
+    loader_t loader;
+    pthread_mutex_init(&loader.mutex, NULL);
+    pthread_cond_init(&loader.cond, NULL);
+    loader.files = files;
+    loader.count = count;
+    loader.layout = layout;
+    loader.luminance = luminance;
+    for (int i = 0; i < LOAD_SLOT_NUM; i++) {
+        loader.state[i] = LOAD_EMPTY;
+    }
+    pthread_create(&loader.thread_id, NULL, load_fragment, &loader);
+
+    search_pool_t pool;
+    init_search_pool(&pool, search, thread_num);
+    for (int n = 0; n < count; n++) {
+        int slot = n % LOAD_SLOT_NUM;
+        pthread_mutex_lock(&loader.mutex);
+        while (loader.state[slot] != LOAD_READY) {
+            pthread_cond_wait(&loader.cond, &loader.mutex);
         }
-        cell->unicode = read_utf8_as_unicode(string, NULL);
-        add_code_book(code_book, cell);
+        pthread_mutex_unlock(&loader.mutex);
+        image_t *image = &loader.image[slot];
+        aa_t aa;
+        init_aa(&aa, image->width / CODE_WIDTH, image->height / CODE_WIDTH);
+        run_search_pool(&pool, image, &aa);
+        // 検索が終われば画像は不要なので、出力より先に次の読み込みに回す
+        pthread_mutex_lock(&loader.mutex);
+        free_image(image);
+        loader.state[slot] = LOAD_EMPTY;
+        pthread_cond_broadcast(&loader.cond);
+        pthread_mutex_unlock(&loader.mutex);
+        char *output = output_file_name(files[n], output_dir, format);
+        FILE *file = fopen(output, "wb");
+        if (file == NULL) {
+            perror(output);
+            exit(EXIT_FAILURE);
+        }
+        print_aa(file, format, &aa);
+        fclose(file);
+        free(output);
+        free_aa(&aa);
     }
+    free_search_pool(&pool, stat);
+    pthread_join(loader.thread_id, NULL);
+    pthread_cond_destroy(&loader.cond);
+    pthread_mutex_destroy(&loader.mutex);
 }
 
-static uint8_t rgb_to_gray(uint8_t r, uint8_t g, uint8_t b) {
-    return (uint8_t) (0.299f * r + 0.587f * g + 0.114f * b + 0.5f);
+// 作業スレッドを thread_num 個起動し、受け付けた接続を待ち行列に積み続ける。戻らない
+// 各要求は1スレッドで処理し、複数の要求を並行して処理する
+static void serve(const char *path, int queue_size, search_t *search, binary_book_t *binary_book, png_option_t *png_option, image_layout_t layout, uint8_t *luminance, int thread_num, int verbose) {
+    // 応答前に切断されたクライアントへの書き込みで終了しないようにする
+    signal(SIGPIPE, SIG_IGN);
+    server_t server;
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.queued_cond, NULL);
+    pthread_cond_init(&server.freed_cond, NULL);
+    server.queue = xmalloc(sizeof(int) * queue_size);
+    server.queue_size = queue_size;
+    server.head = 0;
+    server.count = 0;
+    server.code_book = search->code_book;
+    server.binary_book = binary_book;
+    pthread_mutex_init(&server.glyph_mutex, NULL);
+    server.glyph_state = 0;
+    server.png_option = png_option;
+    server.layout = layout;
+    server.luminance = luminance;
+    server.verbose = verbose;
+    int listen_fd = listen_aa_server(path, queue_size);
+    work_t *works = xmalloc(sizeof(work_t) * thread_num);
+    for (int i = 0; i < thread_num; i++) {
+        init_work(&works[i], search);
+        works[i].server = &server;
+        pthread_create(&works[i].thread_id, NULL, server_fragment, &works[i]);
+    }
+    LOG("%s で待ち受けます (作業スレッド: %d, 待ち行列: %d)", path, thread_num, queue_size);
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+        // 送受信の途中で止まったクライアントが作業スレッドを占有し続けないようにする
+        struct timeval timeout = {SERVER_TIMEOUT_SEC, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        pthread_mutex_lock(&server.mutex);
+        while (server.count == server.queue_size) {
+            pthread_cond_wait(&server.freed_cond, &server.mutex);
+        }
+        server.queue[(server.head + server.count) % server.queue_size] = fd;
+        server.count++;
+        pthread_cond_signal(&server.queued_cond);
+        pthread_mutex_unlock(&server.mutex);
+    }
 }
 
-static void read_png_file(char *filename, image_t *image) {
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        perror(filename);
-        exit(EXIT_FAILURE);
+static void *server_fragment(void *argument) {
+    work_t *work = (work_t *) argument;
+    server_t *server = work->server;
+    for (;;) {
+        pthread_mutex_lock(&server->mutex);
+        while (server->count == 0) {
+            pthread_cond_wait(&server->queued_cond, &server->mutex);
+        }
+        int fd = server->queue[server->head];
+        server->head = (server->head + 1) % server->queue_size;
+        server->count--;
+        pthread_cond_signal(&server->freed_cond);
+        pthread_mutex_unlock(&server->mutex);
+        handle_request(work, fd);
+        close(fd);
     }
-    read_png_stream(file, image);
-    fclose(file);
+    return NULL;
 }
 
-static void read_png_stream(FILE *file, image_t *image) {
-    int i, x, y;
-    int width, height;
-    int num;
-    png_byte sig_bytes[8];
-    if (fread(sig_bytes, sizeof(sig_bytes), 1, file) != 1) {
-        ERR("シグネチャが読み出せません");
-        exit(EXIT_FAILURE);
+// 読み込みに失敗した場合は以降のPNG出力の要求もすべてエラーにする
+static int load_server_glyphs(server_t *server) {
+    pthread_mutex_lock(&server->glyph_mutex);
+    if (server->glyph_state == 0) {
+        int loaded = load_code_book_glyphs(&server->cache, server->code_book, server->binary_book, DEFAULT_FONT_FILE);
+        server->glyph_state = loaded ? 1 : -1;
     }
-    if (png_sig_cmp(sig_bytes, 0, sizeof(sig_bytes))) {
-        ERR("シグネチャが一致しません");
-        exit(EXIT_FAILURE);
+    int glyph_state = server->glyph_state;
+    pthread_mutex_unlock(&server->glyph_mutex);
+    return glyph_state > 0;
+}
+
+// 1回の接続で1枚の画像を変換する。要求が不正な場合も終了せず、エラーを返して次の要求に移る
+static void handle_request(work_t *work, int fd) {
+    server_t *server = work->server;
+    aa_request_t request;
+    if (!read_fully(fd, &request, sizeof(request))) {
+        return;
     }
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png == NULL) {
-        ERR("png_create_read_struct が失敗しました");
-        exit(EXIT_FAILURE);
+    if (memcmp(request.magic, AA_REQUEST_MAGIC, sizeof(request.magic)) != 0 ||
+        request.output > AA_OUTPUT_PNG || request.size > AA_REQUEST_MAX_SIZE) {
+        const char *message = "対応していない要求です";
+        send_response(fd, AA_STATUS_ERROR, message, strlen(message));
+        return;
     }
-    png_infop info = png_create_info_struct(png);
-    if (info == NULL) {
-        ERR("png_create_info_struct が失敗しました");
-        exit(EXIT_FAILURE);
+    uint8_t *data = xmalloc(request.size > 0 ? request.size : 1);
+    if (!read_fully(fd, data, request.size)) {
+        free(data);
+        return;
+    }
+    if (request.output == AA_OUTPUT_PNG && !load_server_glyphs(server)) {
+        free(data);
+        const char *message = "グリフを読み込めません";
+        send_response(fd, AA_STATUS_ERROR, message, strlen(message));
+        return;
     }
-    if (setjmp(png_jmpbuf(png))) {
-        ERR("PNGの読み出しに失敗しました");
+    image_t image;
+    int loaded = read_png_memory(data, request.size, &image, server->layout, server->luminance);
+    free(data);
+    if (!loaded) {
+        const char *message = "PNGの読み出しに失敗しました";
+        send_response(fd, AA_STATUS_ERROR, message, strlen(message));
+        return;
+    }
+    int width = image.width / CODE_WIDTH;
+    int height = image.height / CODE_WIDTH;
+    if (width < 1 || height < 1) {
+        free_image(&image);
+        const char *message = "画像が小さすぎます";
+        send_response(fd, AA_STATUS_ERROR, message, strlen(message));
+        return;
+    }
+    aa_t aa;
+    init_aa(&aa, width, height);
+    schedule_t schedule;
+    init_schedule(&schedule, width, height);
+    work->schedule = &schedule;
+    work->image = &image;
+    work->aa = &aa;
+    work_fragment(work);
+    free_image(&image);
+    char *output = NULL;
+    size_t size = 0;
+    FILE *file = open_memstream(&output, &size);
+    if (file == NULL) {
+        perror("open_memstream");
         exit(EXIT_FAILURE);
     }
-    png_init_io(png, file);
-    png_set_sig_bytes(png, sizeof(sig_bytes));
-    png_read_png(png, info, PNG_TRANSFORM_PACKING | PNG_TRANSFORM_STRIP_16, NULL);
-    width = png_get_image_width(png, info);
-    height = png_get_image_height(png, info);
-    image->map = xmalloc(sizeof(uint8_t*) * height);
-    for (int y = 0; y < height; y++) {
-        image->map[y] = xmalloc(sizeof(uint8_t) * width);
-    }
-    image->width = width;
-    image->height = height;
-    png_bytepp rows = png_get_rows(png, info);
-    switch (png_get_color_type(png, info)) {
-        case PNG_COLOR_TYPE_PALETTE:
-        {
-            png_colorp palette;
-            png_get_PLTE(png, info, &palette, &num);
-            uint8_t p[num];
-            for (i = 0; i < num; i++) {
-                p[i] = rgb_to_gray(palette[i].red, palette[i].green, palette[i].blue);
-            }
-            png_bytep trans = NULL;
-            int num_trans = 0;
-            if (png_get_tRNS(png, info, &trans, &num_trans, NULL) == PNG_INFO_tRNS && trans != NULL && num_trans > 0) {
-                for (i = 0; i < num_trans; i++) {
-                    p[i] = p[i] * trans[i] / 255 + 255 - trans[i];
-                }
-            }
-            for (y = 0; y < height; y++) {
-                png_bytep row = rows[y];
-                for (x = 0; x < width; x++) {
-                    image->map[y][x] = p[*row++];
-                }
-            }
-        }
-            break;
-        case PNG_COLOR_TYPE_GRAY:
-            for (y = 0; y < height; y++) {
-                png_bytep row = rows[y];
-                for (x = 0; x < width; x++) {
-                    image->map[y][x] = *row++;
-                }
-            }
-            break;
-        case PNG_COLOR_TYPE_GRAY_ALPHA:
-            for (y = 0; y < height; y++) {
-                png_bytep row = rows[y];
-                for (x = 0; x < width; x++) {
-                    uint8_t g = *row++;
-                    uint8_t a = *row++;
-                    image->map[y][x] = g * a / 255 + 255 - a;
-                }
-            }
-            break;
-        case PNG_COLOR_TYPE_RGB:  // RGB
-            for (y = 0; y < height; y++) {
-                png_bytep row = rows[y];
-                for (x = 0; x < width; x++) {
-                    uint8_t r = *row++;
-                    uint8_t g = *row++;
-                    uint8_t b = *row++;
-                    image->map[y][x] = rgb_to_gray(r, g, b);
-                }
-            }
-            break;
-        case PNG_COLOR_TYPE_RGB_ALPHA:
-            for (y = 0; y < height; y++) {
-                png_bytep row = rows[y];
-                for (x = 0; x < width; x++) {
-                    uint8_t r = *row++;
-                    uint8_t g = *row++;
-                    uint8_t b = *row++;
-                    uint8_t a = *row++;
-                    uint8_t gray = rgb_to_gray(r, g, b);
-                    image->map[y][x] = gray * a / 255 + 255 - a;
-                }
-            }
-            break;
+    if (request.output == AA_OUTPUT_PNG) {
+        write_band_png(file, width * FONT_WIDTH, FONT_WIDTH, height, server->png_option, render_server_row, work, 1);
+    } else {
+        print_aa(file, (aa_format_t) request.output, &aa);
+    }
+    fclose(file);
+    send_response(fd, AA_STATUS_OK, output, size);
+    if (server->verbose) {
+        LOG("%d x %d の画像を変換しました (%zu バイト)", width, height, size);
     }
+    free(output);
+    free_aa(&aa);
 }
 
-static void free_image(image_t *img) {
-    for (int y = 0; y < img->height; y++) {
-        free(img->map[y]);
+static void render_server_row(void *context, int y, uint8_t **row) {
+    work_t *work = (work_t *) context;
+    render_glyph_row(&work->server->cache, work->aa->map[y], work->aa->width, work->server->png_option->bit_depth, row);
+}
+
+static void send_response(int fd, uint32_t status, const void *data, size_t size) {
+    aa_response_t response;
+    memset(&response, 0, sizeof(response));
+    memcpy(response.magic, AA_RESPONSE_MAGIC, sizeof(response.magic));
+    response.status = status;
+    response.size = size;
+    // 送信できなかった場合はクライアントが切断したものとして何もしない
+    if (write_fully(fd, &response, sizeof(response))) {
+        write_fully(fd, data, size);
     }
-    free(img->map);
 }
 
-static void *work_fragment(void *argument) {
-    work_t *work = (work_t *)argument;
-
-    for (int y = work->start; y < work->end; y++) {
-        for (int x = 0; x < work->aa->width; x++) {
-            uint8_t sample[CODE_SIZE];
-            for (int cy = 0; cy < CODE_WIDTH; cy++) {
-                for (int cx = 0; cx < CODE_WIDTH; cx++) {
-                    sample[cy * CODE_WIDTH + cx] =  work->image->map[y * CODE_WIDTH + cy][x * CODE_WIDTH + cx];
-                }
-            }
-            int min = INT_MAX;
-            int index = 0;
-            for (int i = 0; i <  work->code_book->size; i++) {
-                int d = calculate_distance(sample,  work->code_book->code[i]->code);
-                if (min > d) {
-                    min = d;
-                    index = i;
-                }
-            }
-            work->aa->map[y][x] = work->code_book->code[index]->unicode;
+// 検索側が使い終わった枠に、次の画像を順に読み込む。変換は1スレッドで行い、検索スレッドと競合させない
+static void *load_fragment(void *argument) {
+    loader_t *loader = (loader_t *) argument;
+    for (int n = 0; n < loader->count; n++) {
+        int slot = n % LOAD_SLOT_NUM;
+        pthread_mutex_lock(&loader->mutex);
+        while (loader->state[slot] != LOAD_EMPTY) {
+            pthread_cond_wait(&loader->cond, &loader->mutex);
         }
+        pthread_mutex_unlock(&loader->mutex);
+        read_png_file(loader->files[n], &loader->image[slot], loader->layout, loader->luminance, 1);
+        pthread_mutex_lock(&loader->mutex);
+        loader->state[slot] = LOAD_READY;
+        pthread_cond_broadcast(&loader->cond);
+        pthread_mutex_unlock(&loader->mutex);
     }
+    return NULL;
 }
 
-static void image_to_text(FILE *file, code_book_t *code_book, image_t *image, int thread_num) {
-    int width = image->width / CODE_WIDTH;
-    int height = image->height / CODE_WIDTH;
-    aa_t aa;
-    aa.width = width;
-    aa.height = height;
-    aa.map = xmalloc(sizeof(uint32_t*) * height);
-    for (int i = 0; i < height; i++) {
-        aa.map[i] = xmalloc(sizeof(uint32_t) * width);
-    }
-    int step = 0;
-    work_t *works = xmalloc(sizeof(work_t)* thread_num);
-    if (thread_num > height) {
-        thread_num = height;
+static void init_work(work_t *work, search_t *search) {
+    work->schedule = NULL;
+    work->stream = NULL;
+    work->server = NULL;
+    work->image = NULL;
+    work->aa = NULL;
+    work->buffer = NULL;
+    init_matcher(&work->matcher, search);
+}
+
+static void free_work(work_t *work) {
+    free_matcher(&work->matcher);
+}
+
+static void stream_to_text(FILE *file, aa_format_t format, search_t *search, png_reader_t *reader, image_layout_t layout, int thread_num, search_stat_t *stat) {
+    aa_writer_t writer;
+    init_aa_writer(&writer, file, format, reader->width / CODE_WIDTH, reader->height / CODE_WIDTH);
+    stream_to_aa(search, reader, layout, thread_num, stat, emit_text_row, &writer);
+    free_aa_writer(&writer);
+}
+
+static void emit_text_row(void *context, int y, uint32_t *row) {
+    write_aa_row((aa_writer_t *) context, row);
+}
+
+// 画像全体を読み込まずに、CODE_WIDTH 行ずつの帯 (AAの1行分) を順に読みながら変換し、行ごとに emit に渡す
+// 読み出しは呼び出し元のスレッドが行い、帯のリングを介して検索スレッドに渡す
+static void stream_to_aa(search_t *search, png_reader_t *reader, image_layout_t layout, int thread_num, search_stat_t *stat, emit_row_t emit, void *context) {
+    int width = reader->width / CODE_WIDTH;
+    int height = reader->height / CODE_WIDTH;
+    stream_t stream;
+    pthread_mutex_init(&stream.mutex, NULL);
+    pthread_cond_init(&stream.decoded_cond, NULL);
+    pthread_cond_init(&stream.written_cond, NULL);
+    stream.emit = emit;
+    stream.context = context;
+    stream.reader = reader;
+    stream.height = height;
+    stream.decoded = 0;
+    stream.claimed = 0;
+    stream.written = 0;
+    stream.band_num = thread_num * STREAM_BAND_PER_THREAD;
+    stream.band = xmalloc(sizeof(band_t) * stream.band_num);
+    for (int i = 0; i < stream.band_num; i++) {
+        band_t *band = &stream.band[i];
+        band->done = 0;
+        init_image(&band->image, reader->width, CODE_WIDTH, layout);
+        for (int cy = 0; cy < CODE_WIDTH; cy++) {
+            band->row[cy] = xmalloc(reader->row_bytes);
+        }
+        init_aa(&band->aa, width, 1);
     }
+    work_t *works = xmalloc(sizeof(work_t) * thread_num);
     for (int i = 0; i < thread_num; i++) {
-        works[i].code_book = code_book;
-        works[i].image = image;
-        works[i].aa = &aa;
-        works[i].start = step;
-        step += height / thread_num + (i < height % thread_num);
-        works[i].end = step;
-        pthread_create(&works[i].thread_id, NULL, work_fragment, &works[i]);
+        init_work(&works[i], search);
+        works[i].stream = &stream;
+        works[i].buffer = xmalloc(sizeof(uint8_t) * (reader->width + 1));
+        pthread_create(&works[i].thread_id, NULL, stream_fragment, &works[i]);
+    }
+    for (int line = 0; line < height; line++) {
+        // リングが空くのを待つ。帯の中身は出力されるまで上書きできない
+        pthread_mutex_lock(&stream.mutex);
+        while (line - stream.written >= stream.band_num) {
+            pthread_cond_wait(&stream.written_cond, &stream.mutex);
+        }
+        pthread_mutex_unlock(&stream.mutex);
+        band_t *band = &stream.band[line % stream.band_num];
+        for (int cy = 0; cy < CODE_WIDTH; cy++) {
+            read_png_row(reader, band->row[cy]);
+        }
+        pthread_mutex_lock(&stream.mutex);
+        stream.decoded++;
+        pthread_cond_signal(&stream.decoded_cond);
+        pthread_mutex_unlock(&stream.mutex);
     }
+    memset(stat, 0, sizeof(search_stat_t));
     for (int i = 0; i < thread_num; i++) {
         pthread_join(works[i].thread_id, NULL);
+        add_search_stat(stat, &works[i].matcher.stat);
+        free(works[i].buffer);
+        free_work(&works[i]);
     }
     free(works);
-    fprintf(file, "%d %d\n", width, height);
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            print_unicode_as_utf8(file, aa.map[y][x]);
+    for (int i = 0; i < stream.band_num; i++) {
+        band_t *band = &stream.band[i];
+        for (int cy = 0; cy < CODE_WIDTH; cy++) {
+            free(band->row[cy]);
         }
-        fprintf(file, "\n");
-    }
-    for (int i = 0; i < height; i++) {
-        free(aa.map[i]);
+        free_image(&band->image);
+        free_aa(&band->aa);
     }
-    free(aa.map);
+    free(stream.band);
+    pthread_cond_destroy(&stream.decoded_cond);
+    pthread_cond_destroy(&stream.written_cond);
+    pthread_mutex_destroy(&stream.mutex);
 }
 
-static int calculate_distance(uint8_t *a, uint8_t *b) {
-    int distance = 0;
-    for (int i = 0; i < CODE_SIZE; i++) {
-        distance += abs(a[i] - b[i]);
-    }
-    return distance;
+static void *work_fragment(void *argument) {
+    work_t *work = (work_t *) argument;
+    match_schedule(&work->matcher, work->schedule, work->image, work->aa);
+    return NULL;
 }
 
-static void adjust_luminance(code_book_t *code_book, image_t *image) {
-    int min = 255;
-    for (int i = 0; i < code_book->size; i++) {
-        for (int j = 0; j < CODE_SIZE; ++j) {
-            int p = code_book->code[i]->code[j];
-            if (min > p) {
-                min = p;
+static void *stream_fragment(void *argument) {
+    work_t *work = (work_t *) argument;
+    stream_t *stream = work->stream;
+    pthread_mutex_lock(&stream->mutex);
+    for (;;) {
+        while (stream->claimed == stream->decoded && stream->claimed < stream->height) {
+            pthread_cond_wait(&stream->decoded_cond, &stream->mutex);
+        }
+        if (stream->claimed >= stream->height) {
+            break;
+        }
+        band_t *band = &stream->band[stream->claimed % stream->band_num];
+        stream->claimed++;
+        pthread_mutex_unlock(&stream->mutex);
+        for (int cy = 0; cy < CODE_WIDTH; cy++) {
+            convert_png_image_row(stream->reader, band->row[cy], &band->image, cy, work->buffer);
+        }
+        for (int left = 0; left < band->aa.width; left += TILE_WIDTH) {
+            int right = left + TILE_WIDTH < band->aa.width ? left + TILE_WIDTH : band->aa.width;
+            match_tile(&work->matcher, &band->image, &band->aa, left, 0, right, 1);
+        }
+        // 出力は行の順に行う。先頭の行が終わっていれば、終わっている行までまとめて出力する
+        pthread_mutex_lock(&stream->mutex);
+        band->done = 1;
+        while (stream->written < stream->height) {
+            band_t *next = &stream->band[stream->written % stream->band_num];
+            if (!next->done) {
+                break;
             }
+            stream->emit(stream->context, stream->written, next->aa.map[0]);
+            next->done = 0;
+            stream->written++;
+            pthread_cond_signal(&stream->written_cond);
         }
     }
-    for (int y = 0; y < image->height; ++y) {
-        for (int x = 0; x < image->width; ++x) {
-            image->map[y][x] = (image->map[y][x] * (255 - min)) / 255 + min;
-        }
+    // 他の待っているスレッドにも終了を知らせる
+    pthread_cond_broadcast(&stream->decoded_cond);
+    pthread_mutex_unlock(&stream->mutex);
+    return NULL;
+}
+
+// 検索スレッド群は別スレッドで stream_to_aa を回し、呼び出し元のスレッドはPNGの書き出しを行う
+// 書き出し側の各スレッドは、描画する行の検索が終わるのを待ってからグリフを並べる
+static void stream_to_png(FILE *file, png_option_t *png_option, search_t *search, png_reader_t *reader, image_layout_t layout, glyph_cache_t *cache, int thread_num, search_stat_t *stat) {
+    fused_t fused;
+    pthread_mutex_init(&fused.mutex, NULL);
+    pthread_cond_init(&fused.matched_cond, NULL);
+    init_aa(&fused.aa, reader->width / CODE_WIDTH, reader->height / CODE_WIDTH);
+    fused.matched = 0;
+    fused.cache = cache;
+    fused.bit_depth = png_option->bit_depth;
+    fused.search = search;
+    fused.reader = reader;
+    fused.layout = layout;
+    fused.thread_num = thread_num;
+    fused.stat = stat;
+    pthread_create(&fused.thread_id, NULL, match_fused, &fused);
+    write_band_png(file, fused.aa.width * FONT_WIDTH, FONT_WIDTH, fused.aa.height, png_option,
+                   render_fused_row, &fused, thread_num);
+    pthread_join(fused.thread_id, NULL);
+    free_aa(&fused.aa);
+    pthread_cond_destroy(&fused.matched_cond);
+    pthread_mutex_destroy(&fused.mutex);
+}
+
+static void *match_fused(void *argument) {
+    fused_t *fused = (fused_t *) argument;
+    stream_to_aa(fused->search, fused->reader, fused->layout, fused->thread_num, fused->stat, emit_fused_row, fused);
+    return NULL;
+}
+
+static void emit_fused_row(void *context, int y, uint32_t *row) {
+    fused_t *fused = (fused_t *) context;
+    memcpy(fused->aa.map[y], row, sizeof(uint32_t) * fused->aa.width);
+    pthread_mutex_lock(&fused->mutex);
+    fused->matched = y + 1;
+    pthread_cond_broadcast(&fused->matched_cond);
+    pthread_mutex_unlock(&fused->mutex);
+}
+
+static void render_fused_row(void *context, int y, uint8_t **row) {
+    fused_t *fused = (fused_t *) context;
+    pthread_mutex_lock(&fused->mutex);
+    while (fused->matched <= y) {
+        pthread_cond_wait(&fused->matched_cond, &fused->mutex);
     }
+    pthread_mutex_unlock(&fused->mutex);
+    render_glyph_row(fused->cache, fused->aa.map[y], fused->aa.width, fused->bit_depth, row);
 }
+
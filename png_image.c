@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "png_image.h"
+
+#define PNG_SIGNATURE_SIZE 8
+// メモリから読み出す画像の画素数の上限。展開後の大きさはデータの大きさから分からないため、ヘッダで判定する
+#define MEMORY_PNG_MAX_PIXELS (64 * 1024 * 1024)
+
+typedef struct convert_work_t {
+    pthread_t thread_id;
+    int start;
+    int end;
+    png_reader_t *reader;
+    png_bytepp rows;
+    image_t *image;
+} convert_work_t;
+
+typedef struct memory_source_t {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+} memory_source_t;
+
+static void setup_png_reader(png_structp png, png_infop info, png_reader_t *reader, const uint8_t *luminance);
+static png_bytepp alloc_png_rows(png_reader_t *reader);
+static void free_png_rows(png_reader_t *reader, png_bytepp rows);
+static void convert_png_rows(png_reader_t *reader, png_bytepp rows, image_t *image, image_layout_t layout, int thread_num);
+static void read_memory(png_structp png, png_bytep data, png_size_t length);
+static void init_converter(converter_t *converter, png_structp png, png_infop info, const uint8_t *luminance);
+static void *convert_fragment(void *argument);
+static uint8_t rgb_to_gray(converter_t *converter, uint8_t r, uint8_t g, uint8_t b);
+static uint8_t blend(uint8_t gray, uint8_t alpha);
+static void png_error_exit(png_structp png, png_const_charp message);
+static void png_error_return(png_structp png, png_const_charp message);
+
+void read_png_file(char *filename, image_t *image, image_layout_t layout, const uint8_t *luminance, int thread_num) {
+    FILE *file = open_png_file(filename);
+    read_png_stream(file, image, layout, luminance, thread_num);
+    if (file != stdin) {
+        fclose(file);
+    }
+}
+
+FILE *open_png_file(char *filename) {
+    if (strcmp(filename, "-") == 0) {
+        return stdin;
+    }
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+void read_png_stream(FILE *file, image_t *image, image_layout_t layout, const uint8_t *luminance, int thread_num) {
+    png_reader_t reader;
+    open_png_reader(file, &reader, luminance);
+    png_bytepp rows = alloc_png_rows(&reader);
+    png_read_image(reader.png, rows);
+    convert_png_rows(&reader, rows, image, layout, thread_num);
+    free_png_rows(&reader, rows);
+    close_png_reader(&reader);
+}
+
+// メモリ上のPNGを読み出す。常駐サーバで使うため、壊れたデータでは終了せずに 0 を返す
+int read_png_memory(const uint8_t *data, size_t size, image_t *image, image_layout_t layout, const uint8_t *luminance) {
+    if (size < PNG_SIGNATURE_SIZE || png_sig_cmp(data, 0, PNG_SIGNATURE_SIZE)) {
+        ERR("シグネチャが一致しません");
+        return 0;
+    }
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, png_error_return, NULL);
+    if (png == NULL) {
+        ERR("png_create_read_struct が失敗しました");
+        return 0;
+    }
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        ERR("png_create_info_struct が失敗しました");
+        png_destroy_read_struct(&png, NULL, NULL);
+        return 0;
+    }
+    memory_source_t source = {data, size, PNG_SIGNATURE_SIZE};
+    png_reader_t reader;
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return 0;
+    }
+    png_set_read_fn(png, &source, read_memory);
+    png_set_sig_bytes(png, PNG_SIGNATURE_SIZE);
+    setup_png_reader(png, info, &reader, luminance);
+    if ((uint64_t) reader.width * reader.height > MEMORY_PNG_MAX_PIXELS) {
+        ERR("画像が大きすぎます: %d x %d", reader.width, reader.height);
+        png_destroy_read_struct(&png, &info, NULL);
+        return 0;
+    }
+    png_bytepp rows = alloc_png_rows(&reader);
+    if (setjmp(png_jmpbuf(png))) {
+        free_png_rows(&reader, rows);
+        png_destroy_read_struct(&png, &info, NULL);
+        return 0;
+    }
+    png_read_image(png, rows);
+    convert_png_rows(&reader, rows, image, layout, 1);
+    free_png_rows(&reader, rows);
+    close_png_reader(&reader);
+    return 1;
+}
+
+static png_bytepp alloc_png_rows(png_reader_t *reader) {
+    png_bytepp rows = xmalloc(sizeof(png_bytep) * reader->height);
+    for (int y = 0; y < reader->height; y++) {
+        rows[y] = xmalloc(reader->row_bytes);
+    }
+    return rows;
+}
+
+static void free_png_rows(png_reader_t *reader, png_bytepp rows) {
+    for (int y = 0; y < reader->height; y++) {
+        free(rows[y]);
+    }
+    free(rows);
+}
+
+static void convert_png_rows(png_reader_t *reader, png_bytepp rows, image_t *image, image_layout_t layout, int thread_num) {
+    int height = reader->height;
+    init_image(image, reader->width, height, layout);
+    if (thread_num > height) {
+        thread_num = height;
+    }
+    if (thread_num < 1) {
+        thread_num = 1;
+    }
+    convert_work_t works[thread_num];
+    int step = 0;
+    for (int i = 0; i < thread_num; i++) {
+        works[i].reader = reader;
+        works[i].rows = rows;
+        works[i].image = image;
+        works[i].start = step;
+        step += height / thread_num + (i < height % thread_num);
+        works[i].end = step;
+    }
+    for (int i = 1; i < thread_num; i++) {
+        pthread_create(&works[i].thread_id, NULL, convert_fragment, &works[i]);
+    }
+    convert_fragment(&works[0]);
+    for (int i = 1; i < thread_num; i++) {
+        pthread_join(works[i].thread_id, NULL);
+    }
+}
+
+void open_png_reader(FILE *file, png_reader_t *reader, const uint8_t *luminance) {
+    png_byte sig_bytes[8];
+    if (fread(sig_bytes, sizeof(sig_bytes), 1, file) != 1) {
+        ERR("シグネチャが読み出せません");
+        exit(EXIT_FAILURE);
+    }
+    if (png_sig_cmp(sig_bytes, 0, sizeof(sig_bytes))) {
+        ERR("シグネチャが一致しません");
+        exit(EXIT_FAILURE);
+    }
+    // 読み出しは複数の関数に分かれるため、setjmp ではなくエラー関数で終了する
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, png_error_exit, NULL);
+    if (png == NULL) {
+        ERR("png_create_read_struct が失敗しました");
+        exit(EXIT_FAILURE);
+    }
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        ERR("png_create_info_struct が失敗しました");
+        exit(EXIT_FAILURE);
+    }
+    png_init_io(png, file);
+    png_set_sig_bytes(png, sizeof(sig_bytes));
+    setup_png_reader(png, info, reader, luminance);
+}
+
+static void setup_png_reader(png_structp png, png_infop info, png_reader_t *reader, const uint8_t *luminance) {
+    png_read_info(png, info);
+    png_set_packing(png);
+    // 1, 2, 4ビットのグレースケールは値も 0-255 に広げる (png_set_packing だけでは 0-1 などのまま)
+    if (png_get_color_type(png, info) == PNG_COLOR_TYPE_GRAY && png_get_bit_depth(png, info) < 8) {
+        png_set_expand_gray_1_2_4_to_8(png);
+    }
+    png_set_strip_16(png);
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    reader->png = png;
+    reader->info = info;
+    reader->width = png_get_image_width(png, info);
+    reader->height = png_get_image_height(png, info);
+    reader->row_bytes = png_get_rowbytes(png, info);
+    reader->interlaced = passes > 1;
+    reader->rows = NULL;
+    reader->next = 0;
+    init_converter(&reader->converter, png, info, luminance);
+}
+
+void read_png_row(png_reader_t *reader, png_bytep row) {
+    if (!reader->interlaced) {
+        png_read_row(reader->png, row, NULL);
+        return;
+    }
+    // インターレース画像は行単位で完成しないため、最初に全体を読み込んでおく
+    if (reader->rows == NULL) {
+        reader->rows = xmalloc(sizeof(png_bytep) * reader->height);
+        for (int y = 0; y < reader->height; y++) {
+            reader->rows[y] = xmalloc(reader->row_bytes);
+        }
+        png_read_image(reader->png, reader->rows);
+    }
+    memcpy(row, reader->rows[reader->next++], reader->row_bytes);
+}
+
+void convert_png_row(png_reader_t *reader, png_bytep row, uint8_t *map) {
+    converter_t *converter = &reader->converter;
+    const uint8_t *luminance = converter->luminance;
+    int width = reader->width;
+    switch (converter->color_type) {
+        case PNG_COLOR_TYPE_PALETTE:
+            for (int x = 0; x < width; x++) {
+                map[x] = converter->palette[row[x]];
+            }
+            break;
+        case PNG_COLOR_TYPE_GRAY:
+            for (int x = 0; x < width; x++) {
+                map[x] = luminance[row[x]];
+            }
+            break;
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+            for (int x = 0; x < width; x++) {
+                map[x] = luminance[blend(row[x * 2], row[x * 2 + 1])];
+            }
+            break;
+        case PNG_COLOR_TYPE_RGB:
+            for (int x = 0; x < width; x++) {
+                map[x] = luminance[rgb_to_gray(converter, row[x * 3], row[x * 3 + 1], row[x * 3 + 2])];
+            }
+            break;
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+            for (int x = 0; x < width; x++) {
+                uint8_t gray = rgb_to_gray(converter, row[x * 4], row[x * 4 + 1], row[x * 4 + 2]);
+                map[x] = luminance[blend(gray, row[x * 4 + 3])];
+            }
+            break;
+    }
+}
+
+// 変換した1行を image の y 行目として格納する。ブロック単位の配置では buffer (幅分) を経由して振り分ける
+void convert_png_image_row(png_reader_t *reader, png_bytep row, image_t *image, int y, uint8_t *buffer) {
+    if (image->layout == IMAGE_ROW_MAJOR) {
+        convert_png_row(reader, row, image->map[y]);
+        return;
+    }
+    if (y / CODE_WIDTH >= image->block_height) {
+        return;
+    }
+    convert_png_row(reader, row, buffer);
+    uint8_t (*block)[CODE_STRIDE] = image->block + y / CODE_WIDTH * image->block_width;
+    int offset = y % CODE_WIDTH * CODE_WIDTH;
+    for (int x = 0; x < image->block_width; x++) {
+        for (int cx = 0; cx < CODE_WIDTH; cx++) {
+            block[x][offset + cx] = buffer[x * CODE_WIDTH + cx];
+        }
+    }
+}
+
+void close_png_reader(png_reader_t *reader) {
+    if (reader->rows != NULL) {
+        for (int y = 0; y < reader->height; y++) {
+            free(reader->rows[y]);
+        }
+        free(reader->rows);
+    }
+    png_destroy_read_struct(&reader->png, &reader->info, NULL);
+}
+
+// 画像の輝度を、コードブックの最も暗い画素から255の範囲に圧縮する表
+void init_luminance(code_book_t *code_book, uint8_t *luminance) {
+    int min = 255;
+    for (int i = 0; i < code_book->size; i++) {
+        for (int j = 0; j < CODE_SIZE; ++j) {
+            int p = code_book->code[i]->code[j];
+            if (min > p) {
+                min = p;
+            }
+        }
+    }
+    for (int v = 0; v < 256; v++) {
+        luminance[v] = (uint8_t) ((v * (255 - min)) / 255 + min);
+    }
+}
+
+static void init_converter(converter_t *converter, png_structp png, png_infop info, const uint8_t *luminance) {
+    if (luminance == NULL) {
+        for (int v = 0; v < 256; v++) {
+            converter->identity[v] = (uint8_t) v;
+        }
+        luminance = converter->identity;
+    }
+    converter->color_type = png_get_color_type(png, info);
+    converter->luminance = luminance;
+    // 浮動小数点の係数との積を表にしておく。加算の順序を従来通りにすることで結果は変わらない
+    for (int v = 0; v < 256; v++) {
+        converter->weight[0][v] = 0.299f * v;
+        converter->weight[1][v] = 0.587f * v;
+        converter->weight[2][v] = 0.114f * v;
+    }
+    for (int i = 0; i < 256; i++) {
+        converter->palette[i] = luminance[0];
+    }
+    if (converter->color_type != PNG_COLOR_TYPE_PALETTE) {
+        return;
+    }
+    png_colorp palette;
+    int num;
+    png_get_PLTE(png, info, &palette, &num);
+    png_bytep trans = NULL;
+    int num_trans = 0;
+    if (png_get_tRNS(png, info, &trans, &num_trans, NULL) != PNG_INFO_tRNS || trans == NULL) {
+        num_trans = 0;
+    }
+    for (int i = 0; i < num && i < 256; i++) {
+        uint8_t gray = rgb_to_gray(converter, palette[i].red, palette[i].green, palette[i].blue);
+        if (i < num_trans) {
+            gray = blend(gray, trans[i]);
+        }
+        converter->palette[i] = luminance[gray];
+    }
+}
+
+static void *convert_fragment(void *argument) {
+    convert_work_t *work = (convert_work_t *) argument;
+    uint8_t *buffer = xmalloc(sizeof(uint8_t) * (work->image->width + 1));
+    for (int y = work->start; y < work->end; y++) {
+        convert_png_image_row(work->reader, work->rows[y], work->image, y, buffer);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static uint8_t rgb_to_gray(converter_t *converter, uint8_t r, uint8_t g, uint8_t b) {
+    return (uint8_t) (converter->weight[0][r] + converter->weight[1][g] + converter->weight[2][b] + 0.5f);
+}
+
+// 白背景との合成。x / 255 (0 <= x <= 255 * 255) を (x + 1 + (x >> 8)) >> 8 で求める
+static uint8_t blend(uint8_t gray, uint8_t alpha) {
+    int x = gray * alpha;
+    return (uint8_t) (((x + 1 + (x >> 8)) >> 8) + 255 - alpha);
+}
+
+static void png_error_exit(png_structp png, png_const_charp message) {
+    ERR("PNGの読み出しに失敗しました: %s", message);
+    exit(EXIT_FAILURE);
+}
+
+static void png_error_return(png_structp png, png_const_charp message) {
+    ERR("PNGの読み出しに失敗しました: %s", message);
+    png_longjmp(png, 1);
+}
+
+static void read_memory(png_structp png, png_bytep data, png_size_t length) {
+    memory_source_t *source = (memory_source_t *) png_get_io_ptr(png);
+    if (length > source->size - source->offset) {
+        png_error(png, "データが途中で終わっています");
+    }
+    memcpy(data, source->data + source->offset, length);
+    source->offset += length;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef PNG_IMAGE_H
+#define PNG_IMAGE_H
+
+#include <libpng16/png.h>
+#include "common.h"
+
+// 画素形式の変換、アルファ合成、輝度調整をまとめて1回で行うための表
+typedef struct converter_t {
+    int color_type;
+    const uint8_t *luminance;
+    uint8_t palette[256];
+    uint8_t identity[256];
+    float weight[3][256];
+} converter_t;
+
+// 行単位でPNGを読み出す。read_png_row で得た行を convert_png_row で輝度に変換する
+typedef struct png_reader_t {
+    png_structp png;
+    png_infop info;
+    int width;
+    int height;
+    size_t row_bytes;
+    int interlaced;
+    png_bytepp rows;
+    int next;
+    converter_t converter;
+} png_reader_t;
+
+// luminance は輝度調整の表 (NULLなら調整しない)。画素の変換は thread_num 個のスレッドで分担する
+// ファイル名が "-" の場合は標準入力から読み出す
+void read_png_file(char *filename, image_t *image, image_layout_t layout, const uint8_t *luminance, int thread_num);
+void read_png_stream(FILE *file, image_t *image, image_layout_t layout, const uint8_t *luminance, int thread_num);
+int read_png_memory(const uint8_t *data, size_t size, image_t *image, image_layout_t layout, const uint8_t *luminance);
+FILE *open_png_file(char *filename);
+void open_png_reader(FILE *file, png_reader_t *reader, const uint8_t *luminance);
+void read_png_row(png_reader_t *reader, png_bytep row);
+void convert_png_row(png_reader_t *reader, png_bytep row, uint8_t *map);
+void convert_png_image_row(png_reader_t *reader, png_bytep row, image_t *image, int y, uint8_t *buffer);
+void close_png_reader(png_reader_t *reader);
+void init_luminance(code_book_t *code_book, uint8_t *luminance);
+
+#endif //PNG_IMAGE_H
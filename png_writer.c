@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <libpng16/png.h>
+#include <zlib.h>
+#include "common.h"
+#include "png_writer.h"
+
+// 1バンドあたりのフィルタ後のデータ量の目安
+#define BAND_BYTES (128 * 1024)
+// deflateの窓の大きさ、前のバンドの末尾をこの分だけ辞書として与える
+#define WINDOW_BYTES (32 * 1024)
+#define BAND_PER_THREAD 2
+// zlibヘッダ (2バイト) とAdler-32 (4バイト) を書き込む余白
+#define ZLIB_HEADER_SIZE 2
+#define ZLIB_TRAILER_SIZE 4
+// Z_FULL_FLUSH で追加される空の非圧縮ブロックの分
+#define FLUSH_MARGIN 16
+
+// 連続する unit_per_band 単位分の画素行と、それを圧縮した結果
+// 画素行とフィルタ後のデータは、辞書を作るための前の dict_units 単位分を先頭に含む
+typedef struct png_band_t {
+    uint8_t *pixel;
+    uint8_t **row;
+    uint8_t *filtered;
+    uint8_t *out;
+    size_t out_size;
+    size_t raw_size;
+    uLong adler;
+    int done;
+} png_band_t;
+
+// claimed: 処理を始めたバンド数、written: 書き出し済みのバンド数
+typedef struct png_encoder_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t encoded_cond;
+    pthread_cond_t written_cond;
+    render_unit_t render;
+    void *context;
+    int filter;
+    int level;
+    int strategy;
+    size_t row_bytes;
+    int unit_height;
+    int unit_num;
+    int unit_per_band;
+    int dict_units;
+    int band_count;
+    size_t out_capacity;
+    png_band_t *band;
+    int band_num;
+    int claimed;
+    int written;
+} png_encoder_t;
+
+// prior: 辞書の直前の行を求めるための1単位分の作業領域
+// candidate: ADAPTIVE でフィルタを比較するための作業領域
+typedef struct encode_work_t {
+    pthread_t thread_id;
+    png_encoder_t *encoder;
+    z_stream stream;
+    uint8_t *prior_pixel;
+    uint8_t **prior;
+    uint8_t *zero;
+    uint8_t *candidate;
+} encode_work_t;
+
+static void write_png_header(png_structp png, png_infop info, int width, int height, int bit_depth);
+static void init_encoder(png_encoder_t *encoder, int width, int unit_height, int unit_num, png_option_t *option,
+                         render_unit_t render, void *context, int thread_num);
+static void free_encoder(png_encoder_t *encoder);
+static void *encode_fragment(void *argument);
+static void encode_band(encode_work_t *work, png_band_t *band, int index);
+static void filter_row(int filter, const uint8_t *row, const uint8_t *prior, size_t size, uint8_t *out,
+                       uint8_t *candidate);
+static void apply_filter(int filter, const uint8_t *row, const uint8_t *prior, size_t size, uint8_t *out);
+static unsigned long filter_cost(const uint8_t *filtered, size_t size);
+static int paeth_predictor(int a, int b, int c);
+static void zlib_header(int level, int strategy, uint8_t *header);
+static void png_error_exit(png_structp png, png_const_charp message);
+
+// 行フィルタ名を ROW_FILTER_* に変換する (all は行ごとに選ぶ)。不明な名前であれば 0 を返す
+int parse_row_filter(const char *name, int *filter) {
+    if (strcmp(name, "none") == 0) {
+        *filter = ROW_FILTER_NONE;
+    } else if (strcmp(name, "sub") == 0) {
+        *filter = ROW_FILTER_SUB;
+    } else if (strcmp(name, "up") == 0) {
+        *filter = ROW_FILTER_UP;
+    } else if (strcmp(name, "avg") == 0) {
+        *filter = ROW_FILTER_AVG;
+    } else if (strcmp(name, "paeth") == 0) {
+        *filter = ROW_FILTER_PAETH;
+    } else if (strcmp(name, "all") == 0) {
+        *filter = ROW_FILTER_ADAPTIVE;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// zlibの圧縮戦略名を Z_* の値に変換する。不明な名前であれば 0 を返す
+int parse_png_strategy(const char *name, int *strategy) {
+    if (strcmp(name, "default") == 0) {
+        *strategy = Z_DEFAULT_STRATEGY;
+    } else if (strcmp(name, "filtered") == 0) {
+        *strategy = Z_FILTERED;
+    } else if (strcmp(name, "huffman") == 0) {
+        *strategy = Z_HUFFMAN_ONLY;
+    } else if (strcmp(name, "rle") == 0) {
+        *strategy = Z_RLE;
+    } else if (strcmp(name, "fixed") == 0) {
+        *strategy = Z_FIXED;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// 画像を unit_per_band 単位ずつのバンドに分け、各スレッドがバンドの描画、フィルタ、圧縮までを行う
+// バンドごとに独立した raw deflate ストリームを Z_FULL_FLUSH で終え (最後のバンドのみ Z_FINISH)、
+// 書き出し側でzlibヘッダとAdler-32を付けて順につなげると一つの正しいzlibストリームになる
+// 出力はスレッド数によらず同じになる
+void write_band_png(FILE *file, int width, int unit_height, int unit_num, png_option_t *option,
+                    render_unit_t render, void *context, int thread_num) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, png_error_exit, NULL);
+    if (png == NULL) {
+        ERR("png_create_write_struct に失敗しました");
+        exit(EXIT_FAILURE);
+    }
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        ERR("png_create_info_struct に失敗しました");
+        exit(EXIT_FAILURE);
+    }
+    png_init_io(png, file);
+    write_png_header(png, info, width, unit_height * unit_num, option->bit_depth);
+
+    png_encoder_t encoder;
+    init_encoder(&encoder, width, unit_height, unit_num, option, render, context, thread_num);
+    encode_work_t works[thread_num];
+    for (int i = 0; i < thread_num; i++) {
+        works[i].encoder = &encoder;
+        pthread_create(&works[i].thread_id, NULL, encode_fragment, &works[i]);
+    }
+    uLong adler = adler32(0, NULL, 0);
+    for (int i = 0; i < encoder.band_count; i++) {
+        png_band_t *band = &encoder.band[i % encoder.band_num];
+        pthread_mutex_lock(&encoder.mutex);
+        while (!band->done) {
+            pthread_cond_wait(&encoder.encoded_cond, &encoder.mutex);
+        }
+        pthread_mutex_unlock(&encoder.mutex);
+        adler = adler32_combine(adler, band->adler, band->raw_size);
+        uint8_t *data = band->out + ZLIB_HEADER_SIZE;
+        size_t size = band->out_size;
+        if (i == 0) {
+            data -= ZLIB_HEADER_SIZE;
+            zlib_header(encoder.level, encoder.strategy, data);
+            size += ZLIB_HEADER_SIZE;
+        }
+        if (i == encoder.band_count - 1) {
+            data[size++] = (uint8_t) (adler >> 24);
+            data[size++] = (uint8_t) (adler >> 16);
+            data[size++] = (uint8_t) (adler >> 8);
+            data[size++] = (uint8_t) adler;
+        }
+        png_write_chunk(png, (png_const_bytep) "IDAT", data, size);
+        pthread_mutex_lock(&encoder.mutex);
+        band->done = 0;
+        encoder.written++;
+        pthread_cond_broadcast(&encoder.written_cond);
+        pthread_mutex_unlock(&encoder.mutex);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        pthread_join(works[i].thread_id, NULL);
+    }
+    // IDATを自前で書いているので png_write_end は使わない
+    png_write_chunk(png, (png_const_bytep) "IEND", NULL, 0);
+    png_destroy_write_struct(&png, &info);
+    free_encoder(&encoder);
+}
+
+static void write_png_header(png_structp png, png_infop info, int width, int height, int bit_depth) {
+    if (bit_depth == 1) {
+        // 0: 黒, 1: 白 なのでパレット無しのグレースケールでそのまま表せる
+        png_set_IHDR(png, info, width, height, 1,
+                     PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                     PNG_FILTER_TYPE_DEFAULT);
+    } else {
+        png_set_IHDR(png, info, width, height, 8,
+                     PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                     PNG_FILTER_TYPE_DEFAULT);
+        png_color palette[2];
+        palette[0].red = 0;
+        palette[0].green = 0;
+        palette[0].blue = 0;
+        palette[1].red = 255;
+        palette[1].green = 255;
+        palette[1].blue = 255;
+        png_set_PLTE(png, info, palette, 2);
+    }
+    png_write_info(png, info);
+}
+
+static void init_encoder(png_encoder_t *encoder, int width, int unit_height, int unit_num, png_option_t *option,
+                         render_unit_t render, void *context, int thread_num) {
+    pthread_mutex_init(&encoder->mutex, NULL);
+    pthread_cond_init(&encoder->encoded_cond, NULL);
+    pthread_cond_init(&encoder->written_cond, NULL);
+    encoder->render = render;
+    encoder->context = context;
+    // libpngと同じく、1ビットやパレットの画像はフィルタ無しを既定とする
+    encoder->filter = option->filter >= 0 ? option->filter : ROW_FILTER_NONE;
+    encoder->level = option->level >= 0 ? option->level : Z_DEFAULT_COMPRESSION;
+    if (option->strategy >= 0) {
+        encoder->strategy = option->strategy;
+    } else {
+        encoder->strategy = encoder->filter == ROW_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+    }
+    encoder->row_bytes = ((size_t) width * option->bit_depth + 7) / 8;
+    encoder->unit_height = unit_height;
+    encoder->unit_num = unit_num;
+    size_t unit_bytes = (encoder->row_bytes + 1) * unit_height;
+    encoder->unit_per_band = unit_bytes < BAND_BYTES ? (int) (BAND_BYTES / unit_bytes) : 1;
+    encoder->band_count = (unit_num + encoder->unit_per_band - 1) / encoder->unit_per_band;
+    encoder->dict_units = (WINDOW_BYTES + unit_bytes - 1) / unit_bytes;
+    size_t raw_capacity = unit_bytes * encoder->unit_per_band;
+    encoder->out_capacity = compressBound(raw_capacity) + FLUSH_MARGIN;
+    encoder->band_num = thread_num * BAND_PER_THREAD;
+    if (encoder->band_num > encoder->band_count) {
+        encoder->band_num = encoder->band_count > 0 ? encoder->band_count : 1;
+    }
+    encoder->band = xmalloc(sizeof(png_band_t) * encoder->band_num);
+    int rows = unit_height * (encoder->unit_per_band + encoder->dict_units);
+    for (int i = 0; i < encoder->band_num; i++) {
+        png_band_t *band = &encoder->band[i];
+        band->pixel = xmalloc(encoder->row_bytes * rows);
+        band->row = xmalloc(sizeof(uint8_t *) * rows);
+        for (int r = 0; r < rows; r++) {
+            band->row[r] = band->pixel + encoder->row_bytes * r;
+        }
+        band->filtered = xmalloc(unit_bytes * (encoder->unit_per_band + encoder->dict_units));
+        band->out = xmalloc(ZLIB_HEADER_SIZE + encoder->out_capacity + ZLIB_TRAILER_SIZE);
+        band->done = 0;
+    }
+    encoder->claimed = 0;
+    encoder->written = 0;
+}
+
+static void free_encoder(png_encoder_t *encoder) {
+    for (int i = 0; i < encoder->band_num; i++) {
+        png_band_t *band = &encoder->band[i];
+        free(band->pixel);
+        free(band->row);
+        free(band->filtered);
+        free(band->out);
+    }
+    free(encoder->band);
+    pthread_cond_destroy(&encoder->encoded_cond);
+    pthread_cond_destroy(&encoder->written_cond);
+    pthread_mutex_destroy(&encoder->mutex);
+}
+
+static void *encode_fragment(void *argument) {
+    encode_work_t *work = (encode_work_t *) argument;
+    png_encoder_t *encoder = work->encoder;
+    size_t row_bytes = encoder->row_bytes;
+    work->stream.zalloc = Z_NULL;
+    work->stream.zfree = Z_NULL;
+    work->stream.opaque = Z_NULL;
+    if (deflateInit2(&work->stream, encoder->level, Z_DEFLATED, -MAX_WBITS, 8, encoder->strategy) != Z_OK) {
+        ERR("deflateInit2 に失敗しました");
+        exit(EXIT_FAILURE);
+    }
+    work->prior_pixel = xmalloc(row_bytes * encoder->unit_height);
+    work->prior = xmalloc(sizeof(uint8_t *) * encoder->unit_height);
+    for (int r = 0; r < encoder->unit_height; r++) {
+        work->prior[r] = work->prior_pixel + row_bytes * r;
+    }
+    work->zero = xmalloc(row_bytes);
+    memset(work->zero, 0, row_bytes);
+    work->candidate = xmalloc(row_bytes);
+    pthread_mutex_lock(&encoder->mutex);
+    while (encoder->claimed < encoder->band_count) {
+        int index = encoder->claimed++;
+        while (index - encoder->written >= encoder->band_num) {
+            pthread_cond_wait(&encoder->written_cond, &encoder->mutex);
+        }
+        pthread_mutex_unlock(&encoder->mutex);
+        png_band_t *band = &encoder->band[index % encoder->band_num];
+        encode_band(work, band, index);
+        pthread_mutex_lock(&encoder->mutex);
+        band->done = 1;
+        pthread_cond_broadcast(&encoder->encoded_cond);
+    }
+    pthread_mutex_unlock(&encoder->mutex);
+    deflateEnd(&work->stream);
+    free(work->prior_pixel);
+    free(work->prior);
+    free(work->zero);
+    free(work->candidate);
+    return NULL;
+}
+
+// 圧縮率を保つため、前のバンドの末尾を描画、フィルタし直して辞書にする
+// フィルタ結果は決まっているので、辞書は前のバンドが実際に出力したデータと一致する
+static void encode_band(encode_work_t *work, png_band_t *band, int index) {
+    png_encoder_t *encoder = work->encoder;
+    size_t row_bytes = encoder->row_bytes;
+    size_t unit_bytes = (row_bytes + 1) * encoder->unit_height;
+    int first = index * encoder->unit_per_band;
+    int units = encoder->unit_num - first;
+    if (units > encoder->unit_per_band) {
+        units = encoder->unit_per_band;
+    }
+    int start = first - encoder->dict_units;
+    if (start < 0) {
+        start = 0;
+    }
+    for (int u = start; u < first + units; u++) {
+        encoder->render(encoder->context, u, band->row + (u - start) * encoder->unit_height);
+    }
+    // 先頭行のフィルタには直前の行が必要なので、その単位を描画し直す
+    const uint8_t *prior = work->zero;
+    if (encoder->filter != ROW_FILTER_NONE && start > 0) {
+        encoder->render(encoder->context, start - 1, work->prior);
+        prior = work->prior[encoder->unit_height - 1];
+    }
+    int rows = (first + units - start) * encoder->unit_height;
+    uint8_t *filtered = band->filtered;
+    for (int r = 0; r < rows; r++) {
+        filter_row(encoder->filter, band->row[r], prior, row_bytes, filtered, work->candidate);
+        prior = band->row[r];
+        filtered += row_bytes + 1;
+    }
+    size_t dict_size = unit_bytes * (first - start);
+    uint8_t *data = band->filtered + dict_size;
+    band->raw_size = unit_bytes * units;
+    band->adler = adler32(adler32(0, NULL, 0), data, band->raw_size);
+
+    int last = index == encoder->band_count - 1;
+    z_stream *stream = &work->stream;
+    deflateReset(stream);
+    if (dict_size > 0) {
+        size_t window = dict_size < WINDOW_BYTES ? dict_size : WINDOW_BYTES;
+        deflateSetDictionary(stream, data - window, window);
+    }
+    stream->next_in = data;
+    stream->avail_in = band->raw_size;
+    stream->next_out = band->out + ZLIB_HEADER_SIZE;
+    stream->avail_out = encoder->out_capacity;
+    int result = deflate(stream, last ? Z_FINISH : Z_FULL_FLUSH);
+    if (result != (last ? Z_STREAM_END : Z_OK) || stream->avail_in != 0) {
+        ERR("圧縮に失敗しました");
+        exit(EXIT_FAILURE);
+    }
+    band->out_size = encoder->out_capacity - stream->avail_out;
+}
+
+// 先頭にフィルタの種類を付けて out に書き込む
+static void filter_row(int filter, const uint8_t *row, const uint8_t *prior, size_t size, uint8_t *out,
+                       uint8_t *candidate) {
+    if (filter != ROW_FILTER_ADAPTIVE) {
+        out[0] = filter;
+        apply_filter(filter, row, prior, size, out + 1);
+        return;
+    }
+    // libpngと同じく、差分を符号付きとみなした絶対値の和が最小のものを選ぶ
+    unsigned long best = ULONG_MAX;
+    for (int f = ROW_FILTER_NONE; f <= ROW_FILTER_PAETH; f++) {
+        apply_filter(f, row, prior, size, candidate);
+        unsigned long cost = filter_cost(candidate, size);
+        if (cost < best) {
+            best = cost;
+            out[0] = f;
+            memcpy(out + 1, candidate, size);
+        }
+    }
+}
+
+// 1画素1バイト未満の画像でもフィルタはバイト単位で、左隣は1バイト前になる
+static void apply_filter(int filter, const uint8_t *row, const uint8_t *prior, size_t size, uint8_t *out) {
+    switch (filter) {
+        case ROW_FILTER_NONE:
+            memcpy(out, row, size);
+            break;
+        case ROW_FILTER_SUB:
+            out[0] = row[0];
+            for (size_t i = 1; i < size; i++) {
+                out[i] = row[i] - row[i - 1];
+            }
+            break;
+        case ROW_FILTER_UP:
+            for (size_t i = 0; i < size; i++) {
+                out[i] = row[i] - prior[i];
+            }
+            break;
+        case ROW_FILTER_AVG:
+            out[0] = row[0] - (prior[0] >> 1);
+            for (size_t i = 1; i < size; i++) {
+                out[i] = row[i] - ((row[i - 1] + prior[i]) >> 1);
+            }
+            break;
+        case ROW_FILTER_PAETH:
+            out[0] = row[0] - prior[0];
+            for (size_t i = 1; i < size; i++) {
+                out[i] = row[i] - paeth_predictor(row[i - 1], prior[i], prior[i - 1]);
+            }
+            break;
+    }
+}
+
+static unsigned long filter_cost(const uint8_t *filtered, size_t size) {
+    unsigned long cost = 0;
+    for (size_t i = 0; i < size; i++) {
+        cost += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+    }
+    return cost;
+}
+
+static int paeth_predictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+// deflateInit と同じ値のzlibヘッダ (32KBの窓、FLEVELは圧縮レベルから決める)
+static void zlib_header(int level, int strategy, uint8_t *header) {
+    int flevel;
+    if (level == Z_DEFAULT_COMPRESSION) {
+        level = 6;
+    }
+    if (strategy >= Z_HUFFMAN_ONLY || level < 2) {
+        flevel = 0;
+    } else if (level < 6) {
+        flevel = 1;
+    } else if (level == 6) {
+        flevel = 2;
+    } else {
+        flevel = 3;
+    }
+    int cmf = 0x78;
+    int flg = flevel << 6;
+    flg += 31 - (cmf * 256 + flg) % 31;
+    header[0] = cmf;
+    header[1] = flg;
+}
+
+static void png_error_exit(png_structp png, png_const_charp message) {
+    ERR("PNGの書き出しに失敗しました: %s", message);
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// PNGの行フィルタ (ADAPTIVE は行ごとに最も小さくなりそうなものを選ぶ)
+#define ROW_FILTER_NONE 0
+#define ROW_FILTER_SUB 1
+#define ROW_FILTER_UP 2
+#define ROW_FILTER_AVG 3
+#define ROW_FILTER_PAETH 4
+#define ROW_FILTER_ADAPTIVE 5
+
+// bit_depth: 1 (1ビットグレースケール) または 8 (8ビットパレット)、画素値は 0: 黒, 1: 白
+// level, filter, strategy は負の値なら既定値を使う
+typedef struct png_option_t {
+    int bit_depth;
+    int level;
+    int filter;
+    int strategy;
+} png_option_t;
+
+// unit 番目の単位 (unit_height 画素行) を row に描画する、複数スレッドから同時に呼ばれる
+typedef void (*render_unit_t)(void *context, int unit, uint8_t **row);
+
+int parse_row_filter(const char *name, int *filter);
+int parse_png_strategy(const char *name, int *strategy);
+void write_band_png(FILE *file, int width, int unit_height, int unit_num, png_option_t *option,
+                    render_unit_t render, void *context, int thread_num);
+
+#endif //PNG_WRITER_H
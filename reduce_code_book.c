@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include "common.h"
+#include "png_image.h"
+#include "flat_book.h"
+
+#define REPORT_STEP 10
+#define MAX_DISTANCE (255 * CODE_SIZE)
+
+typedef struct training_t {
+    uint8_t (*sample)[CODE_STRIDE];
+    long *weight;
+    int size;
+    int capacity;
+    long total_weight;
+} training_t;
+
+// 学習サンプルごとに、残っている中で最も近いものと二番目に近いものを保持する
+// ある文字を取り除いたときの誤差の増加量 cost は、その文字を最近傍とするサンプルの (二番目の距離 - 最近傍の距離) の和
+typedef struct reducer_t {
+    code_book_t *code_book;
+    training_t *training;
+    int size;
+    uint8_t (*active)[CODE_STRIDE];
+    int *active_id;
+    int *slot;
+    int *near;
+    int *second;
+    int *near_distance;
+    int *second_distance;
+    long *cost;
+    long total_error;
+} reducer_t;
+
+static void init_training(training_t *training);
+static void free_training(training_t *training);
+static void add_training_image(training_t *training, code_book_t *code_book, char *filename);
+static void add_training_code_book(training_t *training, code_book_t *code_book);
+static void add_training_sample(training_t *training, uint8_t *sample);
+static void merge_training(training_t *training);
+static int compare_sample(const void *a, const void *b);
+static void init_reducer(reducer_t *reducer, code_book_t *code_book, training_t *training);
+static void free_reducer(reducer_t *reducer);
+static void assign_sample(reducer_t *reducer, int s);
+static long contribution(reducer_t *reducer, int s);
+static int find_cheapest(reducer_t *reducer);
+static void remove_entry(reducer_t *reducer, int id);
+static double mean_error(reducer_t *reducer, long total_error);
+static void reduce(reducer_t *reducer, int target, double budget);
+static void print_reduced_code_book(FILE *file, reducer_t *reducer);
+
+int main(int argc, char **argv) {
+    char *code_book_file = NULL;
+    char **image_files = xmalloc(sizeof(char *) * argc);
+    int image_num = 0;
+    int target = 0;
+    double budget = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:i:n:e:")) != -1) {
+        switch (opt) {
+            case 'c':
+                code_book_file = optarg;
+                break;
+            case 'i':
+                image_files[image_num++] = optarg;
+                break;
+            case 'n':
+                target = atoi(optarg);
+                break;
+            case 'e':
+                budget = atof(optarg);
+                break;
+        }
+    }
+    if (code_book_file == NULL) {
+        ERR("使用方法: reduce_code_book -c <code book> [-i <training image>]... [-n <size>] [-e <max error increase>]");
+        return EXIT_FAILURE;
+    }
+    code_book_t book;
+    init_code_book(&book);
+    read_code_book_file(code_book_file, &book);
+    if (book.size == 0) {
+        ERR("コードブックが空です");
+        return EXIT_FAILURE;
+    }
+    training_t training;
+    init_training(&training);
+    if (image_num == 0) {
+        add_training_code_book(&training, &book);
+    }
+    for (int i = 0; i < image_num; i++) {
+        add_training_image(&training, &book, image_files[i]);
+    }
+    merge_training(&training);
+    // 削減目標が無い場合は、誤差が増えない範囲でのみ削減する
+    if (target < 1 && budget < 0) {
+        budget = 0;
+    }
+    if (target < 1) {
+        target = 1;
+    }
+    reducer_t reducer;
+    init_reducer(&reducer, &book, &training);
+    reduce(&reducer, target, budget);
+    print_reduced_code_book(stdout, &reducer);
+    free_reducer(&reducer);
+    free_training(&training);
+    free_code_book(&book);
+    free(image_files);
+    return EXIT_SUCCESS;
+}
+
+static void init_training(training_t *training) {
+    training->size = 0;
+    training->capacity = 1024;
+    training->sample = xmalloc(sizeof(uint8_t[CODE_STRIDE]) * training->capacity);
+    training->weight = xmalloc(sizeof(long) * training->capacity);
+    training->total_weight = 0;
+}
+
+static void free_training(training_t *training) {
+    free(training->sample);
+    free(training->weight);
+}
+
+static void add_training_image(training_t *training, code_book_t *code_book, char *filename) {
+    uint8_t luminance[256];
+    init_luminance(code_book, luminance);
+    image_t image;
+    read_png_file(filename, &image, IMAGE_BLOCK_MAJOR, luminance, 1);
+    uint8_t sample[CODE_STRIDE];
+    for (int y = 0; y < image.block_height; y++) {
+        for (int x = 0; x < image.block_width; x++) {
+            load_sample(&image, x, y, sample);
+            add_training_sample(training, sample);
+        }
+    }
+    free_image(&image);
+}
+
+static void add_training_code_book(training_t *training, code_book_t *code_book) {
+    for (int i = 0; i < code_book->size; i++) {
+        add_training_sample(training, code_book->code[i]->code);
+    }
+}
+
+static void add_training_sample(training_t *training, uint8_t *sample) {
+    if (training->size == training->capacity) {
+        training->capacity *= 2;
+        training->sample = xrealloc(training->sample, sizeof(uint8_t[CODE_STRIDE]) * training->capacity);
+        training->weight = xrealloc(training->weight, sizeof(long) * training->capacity);
+    }
+    pad_sample(training->sample[training->size], sample);
+    training->weight[training->size] = 1;
+    training->size++;
+    training->total_weight++;
+}
+
+// 同じサンプルをまとめて重みにする
+static void merge_training(training_t *training) {
+    if (training->size == 0) {
+        return;
+    }
+    qsort(training->sample, training->size, sizeof(uint8_t[CODE_STRIDE]), compare_sample);
+    int size = 1;
+    training->weight[0] = 1;
+    for (int i = 1; i < training->size; i++) {
+        if (compare_sample(training->sample[size - 1], training->sample[i]) == 0) {
+            training->weight[size - 1]++;
+        } else {
+            memcpy(training->sample[size], training->sample[i], CODE_STRIDE);
+            training->weight[size] = 1;
+            size++;
+        }
+    }
+    training->size = size;
+}
+
+static int compare_sample(const void *a, const void *b) {
+    return memcmp(a, b, CODE_STRIDE);
+}
+
+static void init_reducer(reducer_t *reducer, code_book_t *code_book, training_t *training) {
+    int size = code_book->size;
+    reducer->code_book = code_book;
+    reducer->training = training;
+    reducer->size = size;
+    reducer->active = xmalloc_aligned(FLAT_BOOK_ALIGN, sizeof(uint8_t[CODE_STRIDE]) * size);
+    reducer->active_id = xmalloc(sizeof(int) * size);
+    reducer->slot = xmalloc(sizeof(int) * size);
+    reducer->cost = xmalloc(sizeof(long) * size);
+    for (int i = 0; i < size; i++) {
+        pad_sample(reducer->active[i], code_book->code[i]->code);
+        reducer->active_id[i] = i;
+        reducer->slot[i] = i;
+        reducer->cost[i] = 0;
+    }
+    reducer->near = xmalloc(sizeof(int) * (training->size + 1));
+    reducer->second = xmalloc(sizeof(int) * (training->size + 1));
+    reducer->near_distance = xmalloc(sizeof(int) * (training->size + 1));
+    reducer->second_distance = xmalloc(sizeof(int) * (training->size + 1));
+    reducer->total_error = 0;
+    for (int s = 0; s < training->size; s++) {
+        assign_sample(reducer, s);
+        reducer->cost[reducer->near[s]] += contribution(reducer, s);
+        reducer->total_error += training->weight[s] * reducer->near_distance[s];
+    }
+}
+
+static void free_reducer(reducer_t *reducer) {
+    free(reducer->active);
+    free(reducer->active_id);
+    free(reducer->slot);
+    free(reducer->cost);
+    free(reducer->near);
+    free(reducer->second);
+    free(reducer->near_distance);
+    free(reducer->second_distance);
+}
+
+static void assign_sample(reducer_t *reducer, int s) {
+    uint8_t *sample = reducer->training->sample[s];
+    int first_distance = INT_MAX;
+    int first = argmin_distance(sample, reducer->active, reducer->size, &first_distance);
+    int before_distance = INT_MAX;
+    int before = argmin_distance(sample, reducer->active, first, &before_distance);
+    int after_distance = INT_MAX;
+    int after = argmin_distance(sample, reducer->active + first + 1, reducer->size - first - 1, &after_distance);
+    reducer->near[s] = reducer->active_id[first];
+    reducer->near_distance[s] = first_distance;
+    if (before < 0 && after < 0) {
+        reducer->second[s] = -1;
+        reducer->second_distance[s] = MAX_DISTANCE;
+    } else if (after < 0 || (before >= 0 && before_distance <= after_distance)) {
+        reducer->second[s] = reducer->active_id[before];
+        reducer->second_distance[s] = before_distance;
+    } else {
+        reducer->second[s] = reducer->active_id[first + 1 + after];
+        reducer->second_distance[s] = after_distance;
+    }
+}
+
+static long contribution(reducer_t *reducer, int s) {
+    return reducer->training->weight[s] * (reducer->second_distance[s] - reducer->near_distance[s]);
+}
+
+static int find_cheapest(reducer_t *reducer) {
+    int id = reducer->active_id[0];
+    for (int i = 1; i < reducer->size; i++) {
+        int candidate = reducer->active_id[i];
+        if (reducer->cost[id] > reducer->cost[candidate]) {
+            id = candidate;
+        }
+    }
+    return id;
+}
+
+static void remove_entry(reducer_t *reducer, int id) {
+    reducer->total_error += reducer->cost[id];
+    int slot = reducer->slot[id];
+    int last = reducer->size - 1;
+    memcpy(reducer->active[slot], reducer->active[last], CODE_STRIDE);
+    reducer->active_id[slot] = reducer->active_id[last];
+    reducer->slot[reducer->active_id[slot]] = slot;
+    reducer->slot[id] = -1;
+    reducer->size--;
+    training_t *training = reducer->training;
+    for (int s = 0; s < training->size; s++) {
+        if (reducer->near[s] != id && reducer->second[s] != id) {
+            continue;
+        }
+        if (reducer->near[s] != id) {
+            reducer->cost[reducer->near[s]] -= contribution(reducer, s);
+        }
+        assign_sample(reducer, s);
+        reducer->cost[reducer->near[s]] += contribution(reducer, s);
+    }
+}
+
+static double mean_error(reducer_t *reducer, long total_error) {
+    if (reducer->training->total_weight == 0) {
+        return 0;
+    }
+    return (double) total_error / reducer->training->total_weight;
+}
+
+// 誤差の増加が最も小さいものから一つずつ取り除く
+// 学習サンプルが割り当てられていない (ボロノイ領域が空の) ものは増加量が0なので最初に取り除かれる
+// budget が0以上の場合、平均誤差の増加量が budget を超える手前で止める
+static void reduce(reducer_t *reducer, int target, double budget) {
+    int original = reducer->size;
+    double base_error = mean_error(reducer, reducer->total_error);
+    int step = original / REPORT_STEP > 0 ? original / REPORT_STEP : 1;
+    int next_report = original - step;
+    PRT("size\tmean error\n");
+    PRT("%d\t%.3f\n", reducer->size, mean_error(reducer, reducer->total_error));
+    while (reducer->size > target) {
+        int id = find_cheapest(reducer);
+        if (budget >= 0 && mean_error(reducer, reducer->total_error + reducer->cost[id]) - base_error > budget) {
+            break;
+        }
+        remove_entry(reducer, id);
+        if (reducer->size <= next_report) {
+            PRT("%d\t%.3f\n", reducer->size, mean_error(reducer, reducer->total_error));
+            next_report -= step;
+        }
+    }
+    PRT("%d\t%.3f (result)\n", reducer->size, mean_error(reducer, reducer->total_error));
+}
+
+static void print_reduced_code_book(FILE *file, reducer_t *reducer) {
+    code_book_t *code_book = reducer->code_book;
+    code_book_t reduced;
+    init_code_book(&reduced);
+    for (int i = 0; i < code_book->size; i++) {
+        if (reducer->slot[i] >= 0) {
+            add_code_book(&reduced, code_book->code[i]);
+        }
+    }
+    print_code_book(file, &reduced);
+    free(reduced.code);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <string.h>
+#include "sample_cache.h"
+
+#define SLOT_EMPTY 0
+#define SLOT_WRITING 1
+#define SLOT_READY 2
+
+static uint32_t hash_sample(uint8_t *sample);
+
+void init_sample_cache(sample_cache_t *cache, int size) {
+    uint32_t capacity = 1;
+    while (capacity < (uint32_t) size) {
+        capacity <<= 1;
+    }
+    cache->slot = xmalloc(sizeof(cache_slot_t) * capacity);
+    memset(cache->slot, 0, sizeof(cache_slot_t) * capacity);
+    cache->mask = capacity - 1;
+    cache->limit = capacity / 4 * 3;
+    cache->count = 0;
+}
+
+void free_sample_cache(sample_cache_t *cache) {
+    free(cache->slot);
+}
+
+int lookup_sample_cache(sample_cache_t *cache, uint8_t *sample, int *index) {
+    uint32_t hash = hash_sample(sample);
+    for (int probe = 0; probe < CACHE_MAX_PROBE; probe++) {
+        cache_slot_t *slot = &cache->slot[(hash + probe) & cache->mask];
+        uint8_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state == SLOT_EMPTY) {
+            return 0;
+        }
+        if (state == SLOT_READY && memcmp(slot->key, sample, CODE_SIZE) == 0) {
+            *index = slot->index;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 書き込み中のスロットは読み飛ばすため、同じキーが重複して登録されることがあるが、値は同じなので問題ない
+void insert_sample_cache(sample_cache_t *cache, uint8_t *sample, int index) {
+    if (__atomic_load_n(&cache->count, __ATOMIC_RELAXED) >= cache->limit) {
+        return;
+    }
+    uint32_t hash = hash_sample(sample);
+    for (int probe = 0; probe < CACHE_MAX_PROBE; probe++) {
+        cache_slot_t *slot = &cache->slot[(hash + probe) & cache->mask];
+        uint8_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state == SLOT_READY && memcmp(slot->key, sample, CODE_SIZE) == 0) {
+            return;
+        }
+        if (state != SLOT_EMPTY) {
+            continue;
+        }
+        uint8_t expected = SLOT_EMPTY;
+        if (__atomic_compare_exchange_n(&slot->state, &expected, SLOT_WRITING, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            memcpy(slot->key, sample, CODE_SIZE);
+            slot->index = index;
+            __atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&cache->count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+int sample_cache_count(sample_cache_t *cache) {
+    return __atomic_load_n(&cache->count, __ATOMIC_RELAXED);
+}
+
+// FNV-1a
+static uint32_t hash_sample(uint8_t *sample) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < CODE_SIZE; i++) {
+        hash ^= sample[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef SAMPLE_CACHE_H
+#define SAMPLE_CACHE_H
+
+#include "common.h"
+
+#define DEFAULT_CACHE_SIZE 65536
+#define CACHE_MAX_PROBE 16
+
+typedef struct cache_slot_t {
+    uint8_t key[CODE_SIZE];
+    uint8_t state;
+    int32_t index;
+} cache_slot_t;
+
+// サンプルの9バイトから検索結果のインデックスを引くハッシュ表
+// 登録のみで上書きや削除はしない。容量の3/4まで埋まったらそれ以上登録しないのでメモリ使用量は一定になる
+// スロットの確保はCAS、公開はrelease/acquireで行うため、ロックなしで複数スレッドから利用できる
+typedef struct sample_cache_t {
+    cache_slot_t *slot;
+    uint32_t mask;
+    int limit;
+    int count;
+} sample_cache_t;
+
+void init_sample_cache(sample_cache_t *cache, int size);
+void free_sample_cache(sample_cache_t *cache);
+int lookup_sample_cache(sample_cache_t *cache, uint8_t *sample, int *index);
+void insert_sample_cache(sample_cache_t *cache, uint8_t *sample, int index);
+int sample_cache_count(sample_cache_t *cache);
+
+#endif //SAMPLE_CACHE_H
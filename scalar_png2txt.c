@@ -36,7 +36,6 @@ static int compare_scalar(const void *a, const void *b);
 static uint8_t rgb_to_gray(uint8_t r, uint8_t g, uint8_t b);
 static void read_png_file(char *filename, image_t *image);
 static void read_png_stream(FILE *file, image_t *image);
-static void free_image(image_t *img);
 static void image_to_text(FILE *file, scalar_book_t *scalar_book, image_t *image);
 static void adjust_luminance(image_t *image);
 
@@ -218,12 +217,7 @@ static void read_png_stream(FILE *file, image_t *image) {
     png_read_png(png, info, PNG_TRANSFORM_PACKING | PNG_TRANSFORM_STRIP_16, NULL);
     width = png_get_image_width(png, info);
     height = png_get_image_height(png, info);
-    image->map = xmalloc(sizeof(uint8_t*) * height);
-    for (int y = 0; y < height; y++) {
-        image->map[y] = xmalloc(sizeof(uint8_t) * width);
-    }
-    image->width = width;
-    image->height = height;
+    init_image(image, width, height, IMAGE_ROW_MAJOR);
     png_bytepp rows = png_get_rows(png, info);
     switch (png_get_color_type(png, info)) {
         case PNG_COLOR_TYPE_PALETTE:
@@ -294,13 +288,6 @@ static void read_png_stream(FILE *file, image_t *image) {
     }
 }
 
-static void free_image(image_t *img) {
-    for (int y = 0; y < img->height; y++) {
-        free(img->map[y]);
-    }
-    free(img->map);
-}
-
 static void adjust_luminance(image_t *image) {
     int min = 71;
     for (int y = 0; y < image->height; ++y) {
@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <string.h>
+#include <limits.h>
+#include "search.h"
+
+static int search_code(search_t *search, uint8_t *sample, int *seeds, int seed_count, search_stat_t *stat);
+static int search_exact(search_t *search, uint8_t *sample);
+static int calculate_metric_distance(metric_t metric, uint8_t *a, uint8_t *b);
+static void *pool_fragment(void *argument);
+
+int parse_search_mode(const char *name, search_mode_t *mode) {
+    if (strcmp(name, "brute") == 0) {
+        *mode = SEARCH_BRUTE;
+    } else if (strcmp(name, "sum") == 0) {
+        *mode = SEARCH_SUM;
+    } else if (strcmp(name, "kdtree") == 0) {
+        *mode = SEARCH_KD_TREE;
+    } else if (strcmp(name, "batch") == 0) {
+        *mode = SEARCH_BATCH;
+    } else if (strcmp(name, "ann") == 0) {
+        *mode = SEARCH_ANN;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+int parse_metric(const char *name, metric_t *metric) {
+    if (strcmp(name, "l1") == 0) {
+        *metric = METRIC_L1;
+    } else if (strcmp(name, "l2") == 0) {
+        *metric = METRIC_L2;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// binary_book が NULL でない場合、ベクトルの配列とkd木はマップした領域をそのまま使う
+void init_search(search_t *search, search_option_t *option, code_book_t *code_book, binary_book_t *binary_book) {
+    search->option = *option;
+    search->code_book = code_book;
+    // 一様ベクトルの表は三角不等式を使うため、L1距離の場合のみ利用する
+    search->use_flat_table = option->metric == METRIC_L1;
+    if (search->use_flat_table) {
+        if (binary_book != NULL && binary_book->flat_table != NULL) {
+            search->flat_table = *binary_book->flat_table;
+        } else {
+            init_flat_table(&search->flat_table, code_book);
+        }
+    }
+    if (option->cache_size > 0) {
+        init_sample_cache(&search->cache, option->cache_size);
+    }
+    // 検索結果を正確な検索と比較する場合、L1距離であれば比較用に総和の索引を用意する
+    if (option->evaluate && option->metric == METRIC_L1) {
+        init_sum_index(&search->exact_index, code_book);
+    }
+    switch (option->mode) {
+        case SEARCH_SUM:
+            init_sum_index(&search->sum_index, code_book);
+            break;
+        case SEARCH_KD_TREE:
+        case SEARCH_ANN:
+            if (binary_book != NULL && binary_book->node != NULL) {
+                map_kd_tree(&search->kd_tree, binary_book->size, binary_book->order, binary_book->tree_code,
+                            binary_book->node, binary_book->header->node_size);
+            } else {
+                init_kd_tree(&search->kd_tree, code_book);
+            }
+            break;
+        case SEARCH_BATCH:
+        case SEARCH_BRUTE:
+        default:
+            if (binary_book != NULL) {
+                map_flat_book(&search->flat_book, binary_book->code, binary_book->size);
+            } else {
+                init_flat_book(&search->flat_book, code_book);
+            }
+            if (option->mode == SEARCH_BATCH) {
+                init_batch(&search->batch, &search->flat_book, option->metric);
+            }
+            break;
+    }
+}
+
+void free_search(search_t *search) {
+    if (search->option.cache_size > 0) {
+        free_sample_cache(&search->cache);
+    }
+    if (search->option.evaluate && search->option.metric == METRIC_L1) {
+        free_sum_index(&search->exact_index);
+    }
+    switch (search->option.mode) {
+        case SEARCH_SUM:
+            free_sum_index(&search->sum_index);
+            break;
+        case SEARCH_KD_TREE:
+        case SEARCH_ANN:
+            free_kd_tree(&search->kd_tree);
+            break;
+        case SEARCH_BATCH:
+            free_batch(&search->batch);
+            free_flat_book(&search->flat_book);
+            break;
+        case SEARCH_BRUTE:
+        default:
+            free_flat_book(&search->flat_book);
+            break;
+    }
+}
+
+void init_matcher(matcher_t *matcher, search_t *search) {
+    matcher->search = search;
+    memset(&matcher->stat, 0, sizeof(search_stat_t));
+    matcher->samples = xmalloc_aligned(FLAT_BOOK_ALIGN, sizeof(uint8_t[CODE_STRIDE]) * TILE_CELLS);
+    matcher->position = xmalloc(sizeof(int) * TILE_CELLS);
+    matcher->index = xmalloc(sizeof(int) * TILE_CELLS);
+    matcher->min = xmalloc(sizeof(int) * TILE_CELLS);
+    matcher->chosen = xmalloc(sizeof(int) * TILE_CELLS);
+    matcher->exact = xmalloc(sizeof(int) * TILE_CELLS);
+}
+
+void free_matcher(matcher_t *matcher) {
+    free(matcher->samples);
+    free(matcher->position);
+    free(matcher->index);
+    free(matcher->min);
+    free(matcher->chosen);
+    free(matcher->exact);
+}
+
+void init_schedule(schedule_t *schedule, int width, int height) {
+    schedule->next = 0;
+    schedule->columns = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+    schedule->count = schedule->columns * ((height + TILE_HEIGHT - 1) / TILE_HEIGHT);
+}
+
+// schedule から未処理のタイルを取りながら検索する。複数スレッドから同じ schedule で呼び出して分担する
+void match_schedule(matcher_t *matcher, schedule_t *schedule, image_t *image, aa_t *aa) {
+    int width = aa->width;
+    int height = aa->height;
+    for (;;) {
+        int tile = __atomic_fetch_add(&schedule->next, 1, __ATOMIC_RELAXED);
+        if (tile >= schedule->count) {
+            break;
+        }
+        int left = tile % schedule->columns * TILE_WIDTH;
+        int top = tile / schedule->columns * TILE_HEIGHT;
+        int right = left + TILE_WIDTH < width ? left + TILE_WIDTH : width;
+        int bottom = top + TILE_HEIGHT < height ? top + TILE_HEIGHT : height;
+        match_tile(matcher, image, aa, left, top, right, bottom);
+    }
+}
+
+void match_tile(matcher_t *matcher, image_t *image, aa_t *aa, int left, int top, int right, int bottom) {
+    search_t *search = matcher->search;
+    code_book_t *code_book = search->code_book;
+    int tile_width = right - left;
+    int cells = tile_width * (bottom - top);
+    // キャッシュに無かったサンプルだけを詰めて並べ、まとめて検索する
+    int count = 0;
+    for (int cell = 0; cell < cells; cell++) {
+        int x = left + cell % tile_width;
+        int y = top + cell / tile_width;
+        uint8_t *sample = matcher->samples[count];
+        load_sample(image, x, y, sample);
+        matcher->stat.cell++;
+        if (search->option.evaluate) {
+            matcher->exact[cell] = search_exact(search, sample);
+        }
+        int index;
+        if (search->use_flat_table && lookup_flat_table(&search->flat_table, sample, &index)) {
+            matcher->stat.flat++;
+            matcher->chosen[cell] = index;
+            continue;
+        }
+        if (search->option.cache_size > 0 && lookup_sample_cache(&search->cache, sample, &index)) {
+            matcher->stat.hit++;
+            matcher->chosen[cell] = index;
+            continue;
+        }
+        matcher->position[count++] = cell;
+    }
+    if (search->option.mode == SEARCH_BATCH) {
+        match_batch(&search->batch, matcher->samples, count, matcher->index, matcher->min);
+        matcher->stat.query += count;
+        add_full_distance(&matcher->stat.distance, (long) count * code_book->size);
+    } else {
+        // 左と上のセルで選ばれた文字を初期値にして検索する。同じタイル内で処理済みの場合のみ使える
+        for (int i = 0; i < count; i++) {
+            int cell = matcher->position[i];
+            int seeds[2];
+            int seed_count = 0;
+            if (search->option.seed && cell % tile_width > 0) {
+                seeds[seed_count++] = matcher->chosen[cell - 1];
+            }
+            if (search->option.seed && cell >= tile_width) {
+                seeds[seed_count++] = matcher->chosen[cell - tile_width];
+            }
+            matcher->index[i] = search_code(search, matcher->samples[i], seeds, seed_count, &matcher->stat);
+            matcher->chosen[cell] = matcher->index[i];
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (search->option.cache_size > 0) {
+            insert_sample_cache(&search->cache, matcher->samples[i], matcher->index[i]);
+        }
+        matcher->chosen[matcher->position[i]] = matcher->index[i];
+    }
+    for (int cell = 0; cell < cells; cell++) {
+        int x = left + cell % tile_width;
+        int y = top + cell / tile_width;
+        aa->map[y][x] = code_book->code[matcher->chosen[cell]]->unicode;
+        if (!search->option.evaluate) {
+            continue;
+        }
+        matcher->stat.compared++;
+        if (matcher->chosen[cell] == matcher->exact[cell]) {
+            continue;
+        }
+        uint8_t sample[CODE_STRIDE];
+        load_sample(image, x, y, sample);
+        matcher->stat.mismatch++;
+        matcher->stat.extra_distance +=
+                calculate_metric_distance(search->option.metric, sample, code_book->code[matcher->chosen[cell]]->code) -
+                calculate_metric_distance(search->option.metric, sample, code_book->code[matcher->exact[cell]]->code);
+    }
+}
+
+// 検索と同じ距離で最も近いものを求める。同距離なら位置の小さい方を選ぶ
+static int search_exact(search_t *search, uint8_t *sample) {
+    if (search->option.metric == METRIC_L1) {
+        return search_sum_index(&search->exact_index, sample, INT_MAX, 0, NULL);
+    }
+    code_book_t *code_book = search->code_book;
+    int min = INT_MAX;
+    int index = 0;
+    for (int i = 0; i < code_book->size; i++) {
+        int d = calculate_metric_distance(search->option.metric, sample, code_book->code[i]->code);
+        if (min > d) {
+            min = d;
+            index = i;
+        }
+    }
+    return index;
+}
+
+static int calculate_metric_distance(metric_t metric, uint8_t *a, uint8_t *b) {
+    if (metric == METRIC_L1) {
+        return calculate_distance(a, b);
+    }
+    int distance = 0;
+    for (int i = 0; i < CODE_SIZE; i++) {
+        int d = a[i] - b[i];
+        distance += d * d;
+    }
+    return distance;
+}
+
+static int search_code(search_t *search, uint8_t *sample, int *seeds, int seed_count, search_stat_t *stat) {
+    // 総当たりはSIMDで全件を計算する方が速く、初期値による打ち切りの効果が無いため初期値を使わない
+    if (search->option.mode == SEARCH_BRUTE) {
+        seed_count = 0;
+    }
+    int min = INT_MAX;
+    int index = 0;
+    for (int i = 0; i < seed_count; i++) {
+        int d = calculate_distance(sample, search->code_book->code[seeds[i]]->code);
+        add_full_distance(&stat->distance, 1);
+        if (min > d || (min == d && index > seeds[i])) {
+            min = d;
+            index = seeds[i];
+        }
+    }
+    long visit = 0;
+    switch (search->option.mode) {
+        case SEARCH_SUM:
+            index = search_sum_index(&search->sum_index, sample, min, index, &stat->distance);
+            break;
+        case SEARCH_KD_TREE:
+            index = search_kd_tree(&search->kd_tree, sample, min, index, &visit, &stat->distance);
+            break;
+        case SEARCH_ANN:
+            index = search_kd_tree_approximate(&search->kd_tree, sample, min, index, search->option.max_check,
+                                               &visit, &stat->distance);
+            break;
+        case SEARCH_BRUTE:
+        default:
+            index = search_flat_book(&search->flat_book, sample);
+            add_full_distance(&stat->distance, search->flat_book.size);
+            break;
+    }
+    stat->query++;
+    stat->visit += visit;
+    if (stat->max_visit < visit) {
+        stat->max_visit = visit;
+    }
+    return index;
+}
+
+void init_search_pool(search_pool_t *pool, search_t *search, int thread_num) {
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->generation = 0;
+    pool->running = 0;
+    pool->shutdown = 0;
+    pool->image = NULL;
+    pool->aa = NULL;
+    pool->thread_num = thread_num;
+    pool->worker = xmalloc(sizeof(search_worker_t) * thread_num);
+    for (int i = 0; i < thread_num; i++) {
+        pool->worker[i].pool = pool;
+        init_matcher(&pool->worker[i].matcher, search);
+        pthread_create(&pool->worker[i].thread_id, NULL, pool_fragment, &pool->worker[i]);
+    }
+}
+
+// image を検索して aa を埋め、全スレッドが終わるまで待つ。同時に呼び出せるのは1スレッドのみ
+void run_search_pool(search_pool_t *pool, image_t *image, aa_t *aa) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->image = image;
+    pool->aa = aa;
+    init_schedule(&pool->schedule, aa->width, aa->height);
+    pool->running = pool->thread_num;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->job_cond);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// スレッドを終了させる。stat が NULL でなければ全スレッドの統計を合計して返す
+void free_search_pool(search_pool_t *pool, search_stat_t *stat) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    if (stat != NULL) {
+        memset(stat, 0, sizeof(search_stat_t));
+    }
+    for (int i = 0; i < pool->thread_num; i++) {
+        pthread_join(pool->worker[i].thread_id, NULL);
+        if (stat != NULL) {
+            add_search_stat(stat, &pool->worker[i].matcher.stat);
+        }
+        free_matcher(&pool->worker[i].matcher);
+    }
+    free(pool->worker);
+    pthread_cond_destroy(&pool->job_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+static void *pool_fragment(void *argument) {
+    search_worker_t *worker = (search_worker_t *) argument;
+    search_pool_t *pool = worker->pool;
+    int generation = 0;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->generation == generation && !pool->shutdown) {
+            pthread_cond_wait(&pool->job_cond, &pool->mutex);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+        match_schedule(&worker->matcher, &pool->schedule, pool->image, pool->aa);
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+void add_search_stat(search_stat_t *stat, search_stat_t *add) {
+    stat->cell += add->cell;
+    stat->flat += add->flat;
+    stat->hit += add->hit;
+    stat->query += add->query;
+    stat->visit += add->visit;
+    stat->distance.complete += add->distance.complete;
+    stat->distance.abandoned += add->distance.abandoned;
+    stat->distance.rows += add->distance.rows;
+    stat->compared += add->compared;
+    stat->mismatch += add->mismatch;
+    stat->extra_distance += add->extra_distance;
+    if (stat->max_visit < add->max_visit) {
+        stat->max_visit = add->max_visit;
+    }
+}
+
+void print_search_stat(search_t *search, search_stat_t *stat) {
+    LOG("コードブック: %d 件, 検索回数: %ld, 距離計算: %s", search->code_book->size, stat->query, distance_kernel_name());
+    if (stat->cell > 0) {
+        distance_count_t *d = &stat->distance;
+        LOG("距離計算回数: 1セルあたり平均 %.1f (完了 %.1f, 打ち切り %.1f), 行数換算 %.1f%s",
+            (double) (d->complete + d->abandoned) / stat->cell, (double) d->complete / stat->cell,
+            (double) d->abandoned / stat->cell, (double) d->rows / CODE_WIDTH / stat->cell,
+            search->option.seed && search->option.mode != SEARCH_BRUTE && search->option.mode != SEARCH_BATCH ?
+            " (近傍のセルを初期値に使用)" : "");
+    }
+    if ((search->option.mode == SEARCH_KD_TREE || search->option.mode == SEARCH_ANN) && stat->query > 0) {
+        LOG("kd木ノード数: %d, 訪問ノード数: 平均 %.1f 最大 %ld",
+            search->kd_tree.node_size, (double) stat->visit / stat->query, stat->max_visit);
+    }
+    if (search->use_flat_table && stat->cell > 0) {
+        LOG("一様ブロックの表引き: %ld / %ld (%.1f%%)", stat->flat, stat->cell, 100. * stat->flat / stat->cell);
+    }
+    if (search->option.cache_size > 0 && stat->cell > 0) {
+        LOG("キャッシュ: 登録 %d 件, ヒット %ld / %ld (%.1f%%)", sample_cache_count(&search->cache),
+            stat->hit, stat->cell, 100. * stat->hit / stat->cell);
+    }
+    if (search->option.evaluate && stat->compared > 0) {
+        LOG("正確な検索との不一致: %ld / %ld (%.2f%%), 不一致セルの距離の増加: 平均 %.1f",
+            stat->mismatch, stat->compared, 100. * stat->mismatch / stat->compared,
+            stat->mismatch > 0 ? (double) stat->extra_distance / stat->mismatch : 0.);
+    }
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <pthread.h>
+#include "common.h"
+#include "sum_index.h"
+#include "kd_tree.h"
+#include "flat_book.h"
+#include "batch.h"
+#include "sample_cache.h"
+#include "flat_table.h"
+#include "binary_book.h"
+
+#define TILE_WIDTH 64
+#define TILE_HEIGHT 4
+#define TILE_CELLS (TILE_WIDTH * TILE_HEIGHT)
+#define DEFAULT_MAX_CHECK 64
+
+typedef enum search_mode_t {
+    SEARCH_BRUTE,
+    SEARCH_SUM,
+    SEARCH_KD_TREE,
+    SEARCH_BATCH,
+    SEARCH_ANN,
+} search_mode_t;
+
+typedef struct search_option_t {
+    search_mode_t mode;
+    metric_t metric;
+    int cache_size;
+    int seed;
+    int max_check;
+    int evaluate;
+} search_option_t;
+
+typedef struct search_t {
+    search_option_t option;
+    code_book_t *code_book;
+    flat_book_t flat_book;
+    sum_index_t sum_index;
+    kd_tree_t kd_tree;
+    batch_t batch;
+    int use_flat_table;
+    flat_table_t flat_table;
+    sample_cache_t cache;
+    sum_index_t exact_index;
+} search_t;
+
+typedef struct search_stat_t {
+    long cell;
+    long flat;
+    long hit;
+    long query;
+    long visit;
+    long max_visit;
+    distance_count_t distance;
+    long compared;
+    long mismatch;
+    long extra_distance;
+} search_stat_t;
+
+// AAを TILE_WIDTH x TILE_HEIGHT のタイルに分け、各スレッドは next を進めながら未処理のタイルを一つずつ取る
+typedef struct schedule_t {
+    int next;
+    int columns;
+    int count;
+} schedule_t;
+
+// 1スレッド分の検索の作業領域。タイル内のサンプルと、その検索結果を保持する
+typedef struct matcher_t {
+    search_t *search;
+    uint8_t (*samples)[CODE_STRIDE];
+    int *position;
+    int *index;
+    int *min;
+    int *chosen;
+    int *exact;
+    search_stat_t stat;
+} matcher_t;
+
+typedef struct search_worker_t {
+    pthread_t thread_id;
+    struct search_pool_t *pool;
+    matcher_t matcher;
+} search_worker_t;
+
+// 常駐の検索スレッド群。generation が進むたびに image のタイルを分担して検索する
+// running: 現在の画像をまだ処理しているスレッド数
+typedef struct search_pool_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    int generation;
+    int running;
+    int shutdown;
+    schedule_t schedule;
+    image_t *image;
+    aa_t *aa;
+    int thread_num;
+    search_worker_t *worker;
+} search_pool_t;
+
+int parse_search_mode(const char *name, search_mode_t *mode);
+int parse_metric(const char *name, metric_t *metric);
+void init_search(search_t *search, search_option_t *option, code_book_t *code_book, binary_book_t *binary_book);
+void free_search(search_t *search);
+void init_matcher(matcher_t *matcher, search_t *search);
+void free_matcher(matcher_t *matcher);
+void init_schedule(schedule_t *schedule, int width, int height);
+void match_schedule(matcher_t *matcher, schedule_t *schedule, image_t *image, aa_t *aa);
+void match_tile(matcher_t *matcher, image_t *image, aa_t *aa, int left, int top, int right, int bottom);
+void init_search_pool(search_pool_t *pool, search_t *search, int thread_num);
+void run_search_pool(search_pool_t *pool, image_t *image, aa_t *aa);
+void free_search_pool(search_pool_t *pool, search_stat_t *stat);
+void add_search_stat(search_stat_t *stat, search_stat_t *add);
+void print_search_stat(search_t *search, search_stat_t *stat);
+
+#endif //SEARCH_H
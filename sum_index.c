@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#include <limits.h>
+#include <string.h>
+#include "sum_index.h"
+
+static int sum_code(uint8_t *code);
+static void scan_bucket(sum_index_t *sum_index, int sum, uint8_t *sample, int *min, int *index, distance_count_t *count);
+
+void init_sum_index(sum_index_t *sum_index, code_book_t *code_book) {
+    int size = code_book->size;
+    sum_index->size = size;
+    sum_index->order = xmalloc(sizeof(int) * size);
+    sum_index->code = xmalloc(sizeof(uint8_t[CODE_SIZE]) * size);
+    memset(sum_index->start, 0, sizeof(sum_index->start));
+    for (int i = 0; i < size; i++) {
+        sum_index->start[sum_code(code_book->code[i]->code) + 1]++;
+    }
+    for (int s = 0; s <= SUM_MAX; s++) {
+        sum_index->start[s + 1] += sum_index->start[s];
+    }
+    int fill[SUM_MAX + 1];
+    memcpy(fill, sum_index->start, sizeof(fill));
+    for (int i = 0; i < size; i++) {
+        int pos = fill[sum_code(code_book->code[i]->code)]++;
+        sum_index->order[pos] = i;
+        memcpy(sum_index->code[pos], code_book->code[i]->code, CODE_SIZE);
+    }
+}
+
+void free_sum_index(sum_index_t *sum_index) {
+    free(sum_index->order);
+    free(sum_index->code);
+}
+
+// min と index に近傍のセルの結果などを与えると、それを初期値として探索範囲を絞り込む
+// 初期値が無い場合は min に INT_MAX を与える
+int search_sum_index(sum_index_t *sum_index, uint8_t *sample, int min, int index, distance_count_t *count) {
+    int sum = sum_code(sample);
+    for (int gap = 0; gap <= min; gap++) {
+        int low = sum - gap;
+        int high = sum + gap;
+        if (low < 0 && high > SUM_MAX) {
+            break;
+        }
+        if (low >= 0) {
+            scan_bucket(sum_index, low, sample, &min, &index, count);
+        }
+        if (gap != 0 && high <= SUM_MAX) {
+            scan_bucket(sum_index, high, sample, &min, &index, count);
+        }
+    }
+    return index;
+}
+
+static int sum_code(uint8_t *code) {
+    int sum = 0;
+    for (int i = 0; i < CODE_SIZE; i++) {
+        sum += code[i];
+    }
+    return sum;
+}
+
+static void scan_bucket(sum_index_t *sum_index, int sum, uint8_t *sample, int *min, int *index, distance_count_t *count) {
+    for (int pos = sum_index->start[sum]; pos < sum_index->start[sum + 1]; pos++) {
+        int d = calculate_distance_bounded(sample, sum_index->code[pos], *min, count);
+        int i = sum_index->order[pos];
+        // 総当たりと同じ結果にするため、同距離なら先頭側を優先する
+        if (*min > d || (*min == d && *index > i)) {
+            *min = d;
+            *index = i;
+        }
+    }
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2020 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ */
+
+#ifndef SUM_INDEX_H
+#define SUM_INDEX_H
+
+#include "common.h"
+
+#define SUM_MAX (255 * CODE_SIZE)
+
+// 要素の総和ごとにコードブックを分類した索引
+// L1距離は総和の差以上になるため、総和の近いものから探索し、差が最小距離を超えた時点で打ち切れる
+typedef struct sum_index_t {
+    int size;
+    int *order;
+    uint8_t (*code)[CODE_SIZE];
+    int start[SUM_MAX + 2];
+} sum_index_t;
+
+void init_sum_index(sum_index_t *sum_index, code_book_t *code_book);
+void free_sum_index(sum_index_t *sum_index);
+int search_sum_index(sum_index_t *sum_index, uint8_t *sample, int min, int index, distance_count_t *count);
+
+#endif //SUM_INDEX_H